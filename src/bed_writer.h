@@ -0,0 +1,399 @@
+// ======================================================================
+// PureCLIP: capturing target-specific protein-RNA interaction footprints
+// ======================================================================
+// Copyright (C) 2017  Sabrina Krakau, Max Planck Institute for Molecular
+// Genetics
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// =======================================================================
+// Author: Sabrina Krakau <krakau@molgen.mpg.de>
+// =======================================================================
+
+#ifndef APPS_HMMS_BED_WRITER_H_
+#define APPS_HMMS_BED_WRITER_H_
+
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+#include "bgzf_writer.h"
+#include "posterior_file.h"
+
+using namespace seqan;
+
+// Buffered writer for BED output of crosslink sites and regions
+// Fields are formatted directly into a large buffer (no streams), which is passed to write() once it is full.
+// One writer per output file and thread, output matches BedFileOut/writeRecord() for BedRecord<Bed6>.
+// Instead of a file, the writer can append full buffers to a string (sink).
+
+static size_t const BED_WRITER_BUFFER_SIZE = 4 << 20;
+
+struct BedWriter;
+inline bool close(BedWriter &writer);
+
+struct BedWriter
+{
+    int             fd;
+    std::string *   sink;
+    char *          buffer;
+    size_t          size;
+    bool            good;
+
+    BedWriter() : fd(-1), sink(NULL), buffer(new char[BED_WRITER_BUFFER_SIZE]), size(0), good(true) {}
+    ~BedWriter()
+    {
+        close(*this);
+        delete[] buffer;
+    }
+
+private:
+    BedWriter(BedWriter const &);
+    BedWriter & operator=(BedWriter const &);
+};
+
+inline bool writeBytes(BedWriter &writer, char const * str, size_t n)
+{
+    if (writer.sink != NULL)
+    {
+        writer.sink->append(str, n);
+        return true;
+    }
+    size_t p = 0;
+    while (p < n && writer.good)
+    {
+        ssize_t k = ::write(writer.fd, str + p, n - p);
+        if (k < 0 && errno == EINTR)
+            continue;
+        if (k <= 0)
+            writer.good = false;
+        else
+            p += k;
+    }
+    return writer.good;
+}
+
+inline bool flush(BedWriter &writer)
+{
+    writeBytes(writer, writer.buffer, writer.size);
+    writer.size = 0;
+    return writer.good;
+}
+
+inline bool open(BedWriter &writer, char const * fileName)
+{
+    writer.fd = ::open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    writer.size = 0;
+    writer.good = (writer.fd != -1);
+    return writer.good;
+}
+
+inline bool open(BedWriter &writer, std::string &sink)
+{
+    writer.sink = &sink;
+    writer.size = 0;
+    writer.good = true;
+    return true;
+}
+
+inline bool close(BedWriter &writer)
+{
+    if (writer.sink != NULL)
+    {
+        flush(writer);
+        writer.sink = NULL;
+    }
+    if (writer.fd == -1)
+        return writer.good;
+    flush(writer);
+    if (::close(writer.fd) != 0)
+        writer.good = false;
+    writer.fd = -1;
+    return writer.good;
+}
+
+// make room for at least n bytes
+inline void reserveBedWriter(BedWriter &writer, size_t n)
+{
+    if (writer.size + n > BED_WRITER_BUFFER_SIZE)
+        flush(writer);
+}
+
+inline void appendChar(BedWriter &writer, char c)
+{
+    reserveBedWriter(writer, 1);
+    writer.buffer[writer.size++] = c;
+}
+
+inline void appendChars(BedWriter &writer, char const * str, size_t n)
+{
+    if (n > BED_WRITER_BUFFER_SIZE)
+    {
+        flush(writer);
+        writeBytes(writer, str, n);
+        return;
+    }
+    reserveBedWriter(writer, n);
+    std::memcpy(writer.buffer + writer.size, str, n);
+    writer.size += n;
+}
+
+template <typename TSeq>
+inline void appendChars(BedWriter &writer, TSeq const &seq)
+{
+    appendChars(writer, toCString(seq), length(seq));
+}
+
+inline void appendNumber(BedWriter &writer, __uint64 value)
+{
+    reserveBedWriter(writer, 20);
+    char digits[20];
+    unsigned n = 0;
+    do
+    {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    }
+    while (value != 0);
+    while (n > 0)
+        writer.buffer[writer.size++] = digits[--n];
+}
+
+inline void appendNumber(BedWriter &writer, int value)
+{
+    if (value < 0)
+    {
+        appendChar(writer, '-');
+        appendNumber(writer, (__uint64)(-(__int64)value));
+    }
+    else
+    {
+        appendNumber(writer, (__uint64)value);
+    }
+}
+
+inline void appendNumber(BedWriter &writer, unsigned value)
+{
+    appendNumber(writer, (__uint64)value);
+}
+
+// same format as std::ostream << double with default precision
+inline void appendNumber(BedWriter &writer, double value)
+{
+    reserveBedWriter(writer, 32);
+    int n = std::snprintf(writer.buffer + writer.size, 32, "%g", value);
+    if (n > 0)
+        writer.size += std::min(n, 31);
+}
+
+// BED6 fields ref, beginPos, endPos of one record
+template <typename TRef>
+inline void appendBedPos(BedWriter &writer, TRef const &ref, int beginPos, int endPos)
+{
+    appendChars(writer, ref);
+    appendChar(writer, '\t');
+    appendNumber(writer, beginPos);
+    appendChar(writer, '\t');
+    appendNumber(writer, endPos);
+    appendChar(writer, '\t');
+}
+
+
+// final output file: plain BED or BGZF with tabix index (fileName.tbi) built in the same pass
+struct BedOutputFile
+{
+    bool            bgzf;
+    BedWriter       plain;
+    BgzfWriter      compressed;
+    TabixIndex      index;
+    std::string     fileName;
+
+    BedOutputFile() : bgzf(false) {}
+};
+
+inline bool open(BedOutputFile &file, char const * fileName, bool bgzf, unsigned numThreads)
+{
+    file.bgzf = bgzf;
+    file.fileName = fileName;
+    if (bgzf)
+        return open(file.compressed, fileName, numThreads);
+    return open(file.plain, fileName);
+}
+
+// text has to consist of complete lines
+inline bool write(BedOutputFile &file, char const * text, size_t n)
+{
+    if (!file.bgzf)
+    {
+        appendChars(file.plain, text, n);
+        return file.plain.good;
+    }
+    addBedRecords(file.index, text, n, file.compressed.uOffset);
+    return write(file.compressed, text, n);
+}
+
+inline bool close(BedOutputFile &file)
+{
+    if (!file.bgzf)
+        return close(file.plain);
+    if (!close(file.compressed))
+        return false;
+    std::string indexFileName = file.fileName + ".tbi";
+    if (!writeTabixIndex(file.index, file.compressed, indexFileName.c_str()))
+    {
+        std::cerr << "ERROR: Could not write " << indexFileName << ".\n";
+        return false;
+    }
+    return true;
+}
+
+
+// Output of apply workers, written in contig order by a single writer thread:
+// slot k is written as soon as slots 0..k-1 are written, no temp. files
+// optionally binary posterior blocks of each slot are written into posterior file
+struct OrderedBedOutput
+{
+    BedOutputFile               outSites;
+    BedOutputFile               outRegions;
+    BedWriter                   outPosteriors;
+    bool                        withRegions;
+    bool                        withPosteriors;
+    std::vector<std::string>    sites;
+    std::vector<std::string>    regions;
+    std::vector<std::string>    posteriors;
+    std::vector<__uint64>       posteriorOffsets;   // of non-empty posterior blocks
+    __uint64                    posteriorSize;
+    std::vector<char>           done;
+    unsigned                    next;
+    std::mutex                  mutex;
+    std::condition_variable     cond;
+    std::thread                 writer;
+
+    OrderedBedOutput() : withRegions(false), withPosteriors(false), posteriorSize(0), next(0) {}
+    ~OrderedBedOutput()
+    {
+        if (writer.joinable())
+            writer.join();
+    }
+};
+
+inline void writeOrderedBedOutput(OrderedBedOutput &output)
+{
+    std::string sites;
+    std::string regions;
+    std::string posteriors;
+    while (output.next < output.done.size())
+    {
+        {
+            std::unique_lock<std::mutex> lock(output.mutex);
+            while (!output.done[output.next])
+                output.cond.wait(lock);
+            sites.swap(output.sites[output.next]);
+            regions.swap(output.regions[output.next]);
+            posteriors.swap(output.posteriors[output.next]);
+        }
+        write(output.outSites, sites.data(), sites.size());
+        if (output.withRegions)
+            write(output.outRegions, regions.data(), regions.size());
+        if (output.withPosteriors && !posteriors.empty())
+        {
+            output.posteriorOffsets.push_back(output.posteriorSize);
+            appendChars(output.outPosteriors, posteriors.data(), posteriors.size());
+            output.posteriorSize += posteriors.size();
+        }
+        std::string().swap(sites);
+        std::string().swap(regions);
+        std::string().swap(posteriors);
+        ++output.next;
+    }
+}
+
+// open output files and start writer thread for n slots, regionsFileName may be empty
+// with bgzf, output is compressed using numThreads threads and tabix-indexed
+// posteriorsFileName may be empty, otherwise the file starts with posteriorHeader
+inline bool open(OrderedBedOutput &output, unsigned n, char const * sitesFileName, char const * regionsFileName, bool bgzf, unsigned numThreads,
+                 char const * posteriorsFileName, std::string const &posteriorHeader)
+{
+    if (!open(output.outSites, sitesFileName, bgzf, numThreads))
+    {
+        std::cerr << "ERROR: Could not open " << sitesFileName << " for writing.\n";
+        return false;
+    }
+    output.withRegions = (regionsFileName != NULL && *regionsFileName != '\0');
+    if (output.withRegions && !open(output.outRegions, regionsFileName, bgzf, numThreads))
+    {
+        std::cerr << "ERROR: Could not open " << regionsFileName << " for writing.\n";
+        return false;
+    }
+    output.withPosteriors = (posteriorsFileName != NULL && *posteriorsFileName != '\0');
+    if (output.withPosteriors)
+    {
+        if (!open(output.outPosteriors, posteriorsFileName))
+        {
+            std::cerr << "ERROR: Could not open " << posteriorsFileName << " for writing.\n";
+            return false;
+        }
+        appendChars(output.outPosteriors, posteriorHeader.data(), posteriorHeader.size());
+        output.posteriorSize = posteriorHeader.size();
+        output.posteriorOffsets.clear();
+    }
+    output.sites.resize(n);
+    output.regions.resize(n);
+    output.posteriors.resize(n);
+    output.done.assign(n, 0);
+    output.next = 0;
+    output.writer = std::thread(writeOrderedBedOutput, std::ref(output));
+    return true;
+}
+
+// hand over output of slot k, has to be called once for each slot
+inline void push(OrderedBedOutput &output, unsigned k, std::string &sites, std::string &regions, std::string &posteriors)
+{
+    {
+        std::lock_guard<std::mutex> lock(output.mutex);
+        output.sites[k].swap(sites);
+        output.regions[k].swap(regions);
+        output.posteriors[k].swap(posteriors);
+        output.done[k] = 1;
+    }
+    output.cond.notify_one();
+}
+
+// wait until all slots are written
+inline bool close(OrderedBedOutput &output)
+{
+    if (output.writer.joinable())
+        output.writer.join();
+    bool good = close(output.outSites);
+    if (output.withRegions)
+        good = close(output.outRegions) && good;
+    if (output.withPosteriors)
+    {
+        std::string footer = getPosteriorFileFooter(output.posteriorOffsets, output.posteriorSize);
+        appendChars(output.outPosteriors, footer.data(), footer.size());
+        good = close(output.outPosteriors) && good;
+    }
+    return good;
+}
+
+#endif
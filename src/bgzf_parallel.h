@@ -0,0 +1,393 @@
+// ======================================================================
+// PureCLIP: capturing target-specific protein-RNA interaction footprints
+// ======================================================================
+// Copyright (C) 2017  Sabrina Krakau, Max Planck Institute for Molecular
+// Genetics
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// =======================================================================
+// Author: Sabrina Krakau <krakau@molgen.mpg.de>
+// =======================================================================
+
+#ifndef APPS_HMMS_BGZF_PARALLEL_H_
+#define APPS_HMMS_BGZF_PARALLEL_H_
+
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <zlib.h>
+
+
+// BGZF input stream buffer: worker threads read and inflate blocks ahead,
+// the consuming thread gets the uncompressed blocks in file order
+class BgzfParallelStreamBuf : public std::streambuf
+{
+public:
+    BgzfParallelStreamBuf() : file(NULL), numThreads(0), nextRead(0), nextConsume(0), holding(false), readerAtEnd(false), stopWorkers(false), failed(false) {}
+    ~BgzfParallelStreamBuf() { close(); }
+
+    bool open(char const * fileName, unsigned numThreads_);
+    void close();
+    bool seekVirtual(unsigned long long virtualOffset);
+    unsigned long long tellVirtual();
+    bool hasFailed() { std::lock_guard<std::mutex> lock(mutex); return failed; }    // read or inflate error, stream ended early
+
+protected:
+    int_type underflow();
+
+private:
+    enum BlockState { EMPTY, BUSY, READY, AT_END, FAILED };
+
+    struct Block {
+        std::vector<char>   compressed;
+        std::vector<char>   data;
+        unsigned long long  fileOffset;
+        BlockState          state;
+
+        Block() : fileOffset(0), state(EMPTY) {}
+    };
+
+    // reuse one inflate stream per thread
+    struct Inflater {
+        z_stream zs;
+
+        Inflater()
+        {
+            std::memset(&zs, 0, sizeof(zs));
+            inflateInit2(&zs, -15);     // raw deflate, header is parsed by readBlock()
+        }
+        ~Inflater() { inflateEnd(&zs); }
+
+        bool inflateBlock(Block &block);
+    };
+
+    std::FILE *                 file;
+    unsigned                    numThreads;
+    std::vector<Block>          blocks;         // ring buffer of blocks in flight
+    std::vector<std::thread>    workers;
+    std::mutex                  mutex;
+    std::condition_variable     condWorkers;
+    std::condition_variable     condConsumer;
+    unsigned long long          nextRead;
+    unsigned long long          nextConsume;
+    bool                        holding;        // consumer currently reads from blocks[nextConsume]
+    bool                        readerAtEnd;
+    bool                        stopWorkers;
+    bool                        failed;
+    Inflater                    inflater;       // only used without worker threads
+
+    bool readBlock(Block &block);
+    void startWorkers();
+    void joinWorkers();
+    void worker();
+    bool nextBlockSingle();
+};
+
+
+// read next compressed BGZF block from file, returns false at end of file or on error (sets failed)
+inline bool BgzfParallelStreamBuf::readBlock(Block &block)
+{
+    unsigned char header[12];
+    block.fileOffset = ftello(file);
+    size_t n = std::fread(header, 1, 12, file);
+    if (n == 0)
+        return false;
+    if (n < 12 || header[0] != 31 || header[1] != 139 || header[2] != 8 || (header[3] & 4) == 0)
+    {
+        std::cerr << "ERROR: Invalid BGZF block header at file offset " << block.fileOffset << ".\n";
+        failed = true;
+        return false;
+    }
+    unsigned xlen = header[10] | (header[11] << 8);
+    unsigned char extra[65536];
+    if (std::fread(extra, 1, xlen, file) != xlen)
+    {
+        failed = true;
+        return false;
+    }
+    // find BC subfield containing total block size - 1
+    unsigned blockSize = 0;
+    for (unsigned i = 0; i + 4 <= xlen; )
+    {
+        unsigned slen = extra[i + 2] | (extra[i + 3] << 8);
+        if (extra[i] == 'B' && extra[i + 1] == 'C' && slen == 2 && i + 6 <= xlen)
+            blockSize = (extra[i + 4] | (extra[i + 5] << 8)) + 1;
+        i += 4 + slen;
+    }
+    if (blockSize < 12 + xlen + 8)
+    {
+        std::cerr << "ERROR: BGZF block without block size at file offset " << block.fileOffset << ".\n";
+        failed = true;
+        return false;
+    }
+    block.compressed.resize(blockSize - 12 - xlen);
+    if (std::fread(&block.compressed[0], 1, block.compressed.size(), file) != block.compressed.size())
+    {
+        std::cerr << "ERROR: Truncated BGZF block at file offset " << block.fileOffset << ".\n";
+        failed = true;
+        return false;
+    }
+    return true;
+}
+
+
+inline bool BgzfParallelStreamBuf::Inflater::inflateBlock(Block &block)
+{
+    size_t cSize = block.compressed.size();
+    unsigned char const * footer = reinterpret_cast<unsigned char const *>(&block.compressed[cSize - 8]);
+    unsigned long crc = footer[0] | (footer[1] << 8) | (footer[2] << 16) | ((unsigned long)footer[3] << 24);
+    unsigned long uSize = footer[4] | (footer[5] << 8) | (footer[6] << 16) | ((unsigned long)footer[7] << 24);
+    if (uSize > 65536)
+        return false;
+
+    block.data.resize(uSize);
+    if (uSize == 0)         // empty block, e.g. EOF marker
+        return true;
+
+    inflateReset(&zs);
+    zs.next_in = reinterpret_cast<Bytef *>(&block.compressed[0]);
+    zs.avail_in = cSize - 8;
+    zs.next_out = reinterpret_cast<Bytef *>(&block.data[0]);
+    zs.avail_out = uSize;
+    if (inflate(&zs, Z_FINISH) != Z_STREAM_END || zs.avail_out != 0)
+        return false;
+
+    return crc32(crc32(0L, Z_NULL, 0), reinterpret_cast<Bytef *>(&block.data[0]), uSize) == crc;
+}
+
+
+inline void BgzfParallelStreamBuf::worker()
+{
+    Inflater threadInflater;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        // wait until the slot of the next block to read is free
+        while (!stopWorkers && (readerAtEnd || blocks[nextRead % blocks.size()].state != EMPTY))
+            condWorkers.wait(lock);
+        if (stopWorkers)
+            return;
+
+        Block &block = blocks[nextRead % blocks.size()];
+        ++nextRead;
+        // file is read sequentially while holding the lock, inflating is done in parallel
+        if (!readBlock(block))
+        {
+            readerAtEnd = true;
+            block.state = (failed) ? FAILED : AT_END;
+            condConsumer.notify_all();
+            continue;
+        }
+        block.state = BUSY;
+
+        lock.unlock();
+        bool ok = threadInflater.inflateBlock(block);
+        lock.lock();
+
+        if (!ok)
+        {
+            std::cerr << "ERROR: Could not inflate BGZF block at file offset " << block.fileOffset << ".\n";
+            failed = true;
+        }
+        block.state = (ok) ? READY : FAILED;
+        condConsumer.notify_all();
+    }
+}
+
+
+inline void BgzfParallelStreamBuf::startWorkers()
+{
+    nextRead = 0;
+    nextConsume = 0;
+    holding = false;
+    readerAtEnd = false;
+    stopWorkers = false;
+    for (unsigned i = 0; i < blocks.size(); ++i)
+        blocks[i].state = EMPTY;
+    for (unsigned i = 0; i < numThreads; ++i)
+        workers.push_back(std::thread(&BgzfParallelStreamBuf::worker, this));
+}
+
+
+inline void BgzfParallelStreamBuf::joinWorkers()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopWorkers = true;
+    }
+    condWorkers.notify_all();
+    for (unsigned i = 0; i < workers.size(); ++i)
+        workers[i].join();
+    workers.clear();
+}
+
+
+inline bool BgzfParallelStreamBuf::open(char const * fileName, unsigned numThreads_)
+{
+    close();
+    file = std::fopen(fileName, "rb");
+    if (file == NULL)
+        return false;
+
+    failed = false;
+    numThreads = numThreads_;
+    if (numThreads > 0)
+    {
+        blocks.resize(numThreads * 4);       // allow workers to inflate ahead
+        startWorkers();
+    }
+    else
+    {
+        blocks.resize(1);
+        blocks[0].state = EMPTY;
+    }
+    setg(NULL, NULL, NULL);
+    return true;
+}
+
+
+inline void BgzfParallelStreamBuf::close()
+{
+    joinWorkers();
+    if (file != NULL)
+        std::fclose(file);
+    file = NULL;
+    blocks.clear();
+    setg(NULL, NULL, NULL);
+}
+
+
+// without worker threads: read and inflate next block on calling thread
+inline bool BgzfParallelStreamBuf::nextBlockSingle()
+{
+    Block &block = blocks[0];
+    while (true)
+    {
+        if (!readBlock(block))
+        {
+            block.state = (failed) ? FAILED : AT_END;
+            return false;
+        }
+        if (!inflater.inflateBlock(block))
+        {
+            std::cerr << "ERROR: Could not inflate BGZF block at file offset " << block.fileOffset << ".\n";
+            failed = true;
+            block.state = FAILED;
+            return false;
+        }
+        block.state = READY;
+        if (!block.data.empty())
+            return true;
+    }
+}
+
+
+inline BgzfParallelStreamBuf::int_type BgzfParallelStreamBuf::underflow()
+{
+    if (gptr() < egptr())
+        return traits_type::to_int_type(*gptr());
+    if (file == NULL)
+        return traits_type::eof();
+
+    if (numThreads == 0)
+    {
+        if (!nextBlockSingle())
+            return traits_type::eof();
+        setg(&blocks[0].data[0], &blocks[0].data[0], &blocks[0].data[0] + blocks[0].data.size());
+        return traits_type::to_int_type(*gptr());
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        // release block consumed so far
+        if (holding)
+        {
+            blocks[nextConsume % blocks.size()].state = EMPTY;
+            ++nextConsume;
+            holding = false;
+            condWorkers.notify_all();
+        }
+
+        Block &block = blocks[nextConsume % blocks.size()];
+        while (block.state == EMPTY || block.state == BUSY)
+            condConsumer.wait(lock);
+
+        if (block.state == AT_END || block.state == FAILED)
+        {
+            setg(NULL, NULL, NULL);
+            return traits_type::eof();
+        }
+
+        holding = true;
+        if (block.data.empty())     // skip empty blocks
+            continue;
+
+        setg(&block.data[0], &block.data[0], &block.data[0] + block.data.size());
+        return traits_type::to_int_type(*gptr());
+    }
+}
+
+
+// virtual file offset: compressed block offset << 16 | offset within uncompressed block
+inline unsigned long long BgzfParallelStreamBuf::tellVirtual()
+{
+    if (gptr() == NULL && traits_type::eq_int_type(underflow(), traits_type::eof()))
+        return (unsigned long long)ftello(file) << 16;
+
+    unsigned long long fileOffset;
+    if (numThreads == 0)
+    {
+        fileOffset = blocks[0].fileOffset;
+    }
+    else
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        fileOffset = blocks[nextConsume % blocks.size()].fileOffset;
+    }
+    return (fileOffset << 16) | (unsigned long long)(gptr() - eback());
+}
+
+
+inline bool BgzfParallelStreamBuf::seekVirtual(unsigned long long virtualOffset)
+{
+    if (file == NULL)
+        return false;
+
+    // stop read-ahead, restart at new position
+    joinWorkers();
+    setg(NULL, NULL, NULL);
+    if (fseeko(file, (off_t)(virtualOffset >> 16), SEEK_SET) != 0)
+        return false;
+    if (numThreads > 0)
+        startWorkers();
+    else
+        blocks[0].state = EMPTY;
+
+    unsigned skip = virtualOffset & 0xFFFF;
+    if (traits_type::eq_int_type(underflow(), traits_type::eof()))
+        return skip == 0;
+    if ((unsigned)(egptr() - gptr()) < skip)
+        return false;
+    gbump(skip);
+    return true;
+}
+
+
+#endif
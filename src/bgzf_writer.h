@@ -0,0 +1,330 @@
+// ======================================================================
+// PureCLIP: capturing target-specific protein-RNA interaction footprints
+// ======================================================================
+// Copyright (C) 2017  Sabrina Krakau, Max Planck Institute for Molecular
+// Genetics
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// =======================================================================
+// Author: Sabrina Krakau <krakau@molgen.mpg.de>
+// =======================================================================
+
+#ifndef APPS_HMMS_BGZF_WRITER_H_
+#define APPS_HMMS_BGZF_WRITER_H_
+
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <limits>
+#include <zlib.h>
+
+using namespace seqan;
+
+// BGZF output: data is split into blocks of BGZF_BLOCK_SIZE uncompressed bytes,
+// batches of blocks are deflated in parallel and written in order.
+// Block i starts at uncompressed offset i * BGZF_BLOCK_SIZE, so virtual offsets can be computed
+// from uncompressed offsets once the compressed block offsets are known.
+
+static size_t const BGZF_BLOCK_SIZE = 0xff00;
+static size_t const BGZF_MAX_BLOCK_SIZE = 0x10000;
+
+// deflate one block including BGZF header and footer, returns false on error
+inline bool compressBgzfBlock(std::vector<char> &block, char const * data, size_t n, int level)
+{
+    block.resize(BGZF_MAX_BLOCK_SIZE);
+    unsigned char * out = reinterpret_cast<unsigned char *>(&block[0]);
+    static unsigned char const header[16] = {31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0};
+
+    size_t cSize = 0;
+    for (int l = level; ; l = Z_NO_COMPRESSION)
+    {
+        z_stream zs;
+        std::memset(&zs, 0, sizeof(zs));
+        if (deflateInit2(&zs, l, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return false;
+        zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+        zs.avail_in = n;
+        zs.next_out = out + 18;
+        zs.avail_out = BGZF_MAX_BLOCK_SIZE - 18 - 8;
+        int res = deflate(&zs, Z_FINISH);
+        cSize = zs.total_out;
+        deflateEnd(&zs);
+        if (res == Z_STREAM_END)
+            break;
+        if (l == Z_NO_COMPRESSION)      // does not fit even if stored
+            return false;
+    }
+
+    size_t blockSize = 18 + cSize + 8;
+    std::memcpy(out, header, 16);
+    out[16] = (blockSize - 1) & 0xff;
+    out[17] = (blockSize - 1) >> 8;
+    unsigned long crc = crc32(crc32(0L, Z_NULL, 0), reinterpret_cast<Bytef const *>(data), n);
+    unsigned char * footer = out + 18 + cSize;
+    for (unsigned i = 0; i < 4; ++i)
+    {
+        footer[i] = (crc >> (8 * i)) & 0xff;
+        footer[4 + i] = ((__uint64)n >> (8 * i)) & 0xff;
+    }
+    block.resize(blockSize);
+    return true;
+}
+
+
+struct BgzfWriter
+{
+    std::FILE *             file;
+    unsigned                numThreads;
+    int                     level;
+    std::vector<char>       pending;        // uncompressed data not yet compressed
+    std::vector<__uint64>   blockOffsets;   // file offset of each written block
+    __uint64                fileOffset;
+    __uint64                uOffset;        // uncompressed bytes passed so far
+    bool                    good;
+
+    BgzfWriter() : file(NULL), numThreads(1), level(Z_DEFAULT_COMPRESSION), fileOffset(0), uOffset(0), good(true) {}
+    ~BgzfWriter()
+    {
+        if (file != NULL)
+            std::fclose(file);
+    }
+
+private:
+    BgzfWriter(BgzfWriter const &);
+    BgzfWriter & operator=(BgzfWriter const &);
+};
+
+inline bool open(BgzfWriter &writer, char const * fileName, unsigned numThreads)
+{
+    writer.file = std::fopen(fileName, "wb");
+    writer.numThreads = std::max(numThreads, 1u);
+    writer.fileOffset = 0;
+    writer.uOffset = 0;
+    writer.pending.clear();
+    writer.blockOffsets.clear();
+    writer.good = (writer.file != NULL);
+    return writer.good;
+}
+
+// compress pending data in parallel, last incomplete block only if final
+inline void compressPending(BgzfWriter &writer, bool final)
+{
+    size_t nBlocks = writer.pending.size() / BGZF_BLOCK_SIZE;
+    if (final && writer.pending.size() % BGZF_BLOCK_SIZE != 0)
+        ++nBlocks;
+    if (nBlocks == 0)
+        return;
+
+    std::vector<std::vector<char> > blocks(nBlocks);
+    bool ok = true;
+#if HMM_PARALLEL
+    SEQAN_OMP_PRAGMA(parallel for num_threads(writer.numThreads) schedule(static, 1))
+#endif
+    for (int b = 0; b < (int)nBlocks; ++b)
+    {
+        size_t n = std::min(BGZF_BLOCK_SIZE, writer.pending.size() - b * BGZF_BLOCK_SIZE);
+        if (!compressBgzfBlock(blocks[b], &writer.pending[b * BGZF_BLOCK_SIZE], n, writer.level))
+            ok = false;
+    }
+    if (!ok)
+        writer.good = false;
+    for (size_t b = 0; b < nBlocks && writer.good; ++b)
+    {
+        writer.blockOffsets.push_back(writer.fileOffset);
+        if (std::fwrite(&blocks[b][0], 1, blocks[b].size(), writer.file) != blocks[b].size())
+            writer.good = false;
+        writer.fileOffset += blocks[b].size();
+    }
+    writer.pending.erase(writer.pending.begin(), writer.pending.begin() + std::min(writer.pending.size(), nBlocks * BGZF_BLOCK_SIZE));
+}
+
+inline bool write(BgzfWriter &writer, char const * data, size_t n)
+{
+    writer.pending.insert(writer.pending.end(), data, data + n);
+    writer.uOffset += n;
+    if (writer.pending.size() >= 16 * writer.numThreads * BGZF_BLOCK_SIZE)
+        compressPending(writer, false);
+    return writer.good;
+}
+
+// virtual offset of uncompressed offset, only valid for data already compressed
+inline __uint64 getVirtualOffset(BgzfWriter const &writer, __uint64 uOffset)
+{
+    size_t b = uOffset / BGZF_BLOCK_SIZE;
+    __uint64 cOffset = (b < writer.blockOffsets.size()) ? writer.blockOffsets[b] : writer.fileOffset;
+    return (cOffset << 16) | (uOffset % BGZF_BLOCK_SIZE);
+}
+
+// compress remaining data and append EOF marker block
+inline bool close(BgzfWriter &writer)
+{
+    if (writer.file == NULL)
+        return writer.good;
+    compressPending(writer, true);
+    static unsigned char const eofBlock[28] = {31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0, 27, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    if (std::fwrite(eofBlock, 1, 28, writer.file) != 28)
+        writer.good = false;
+    if (std::fclose(writer.file) != 0)
+        writer.good = false;
+    writer.file = NULL;
+    return writer.good;
+}
+
+
+// Tabix index (.tbi) of BED records, built from the records while they are written
+// chunks and linear index hold uncompressed offsets until the index is written
+struct TabixIndexRef
+{
+    std::map<unsigned, std::vector<std::pair<__uint64, __uint64> > >   bins;
+    std::vector<__uint64>                                               linear;    // per 16kbp window, max if not set
+};
+
+struct TabixIndex
+{
+    std::vector<std::string>        names;
+    std::map<std::string, unsigned> nameIds;
+    std::vector<TabixIndexRef>      refs;
+};
+
+// UCSC binning scheme as used by BAI and tabix, [beginPos, endPos)
+inline unsigned tabixReg2Bin(__uint64 beginPos, __uint64 endPos)
+{
+    --endPos;
+    if (beginPos >> 14 == endPos >> 14) return ((1 << 15) - 1) / 7 + (beginPos >> 14);
+    if (beginPos >> 17 == endPos >> 17) return ((1 << 12) - 1) / 7 + (beginPos >> 17);
+    if (beginPos >> 20 == endPos >> 20) return ((1 << 9) - 1) / 7 + (beginPos >> 20);
+    if (beginPos >> 23 == endPos >> 23) return ((1 << 6) - 1) / 7 + (beginPos >> 23);
+    if (beginPos >> 26 == endPos >> 26) return ((1 << 3) - 1) / 7 + (beginPos >> 26);
+    return 0;
+}
+
+inline void addRecord(TabixIndex &index, std::string const &name, __uint64 beginPos, __uint64 endPos, __uint64 uBegin, __uint64 uEnd)
+{
+    std::map<std::string, unsigned>::iterator it = index.nameIds.find(name);
+    if (it == index.nameIds.end())
+    {
+        it = index.nameIds.insert(std::make_pair(name, (unsigned)index.names.size())).first;
+        index.names.push_back(name);
+        index.refs.resize(index.names.size());
+    }
+    TabixIndexRef &ref = index.refs[it->second];
+    if (endPos <= beginPos)
+        endPos = beginPos + 1;
+
+    std::vector<std::pair<__uint64, __uint64> > &chunks = ref.bins[tabixReg2Bin(beginPos, endPos)];
+    if (!chunks.empty() && chunks.back().second == uBegin)
+        chunks.back().second = uEnd;
+    else
+        chunks.push_back(std::make_pair(uBegin, uEnd));
+
+    size_t w2 = (endPos - 1) >> 14;
+    if (ref.linear.size() <= w2)
+        ref.linear.resize(w2 + 1, std::numeric_limits<__uint64>::max());
+    for (size_t w = beginPos >> 14; w <= w2; ++w)
+        ref.linear[w] = std::min(ref.linear[w], uBegin);
+}
+
+// add all complete BED lines of text starting at uncompressed offset uOffset
+inline void addBedRecords(TabixIndex &index, char const * text, size_t n, __uint64 uOffset)
+{
+    std::string name;
+    size_t p = 0;
+    while (p < n)
+    {
+        char const * line = text + p;
+        char const * lineEnd = static_cast<char const *>(std::memchr(line, '\n', n - p));
+        size_t lineLength = (lineEnd == NULL) ? n - p : lineEnd - line + 1;
+
+        // ref, beginPos, endPos
+        char const * f = line;
+        char const * e = line + lineLength;
+        char const * tab = static_cast<char const *>(std::memchr(f, '\t', e - f));
+        if (tab != NULL && *line != '#')
+        {
+            name.assign(f, tab);
+            __uint64 pos[2] = {0, 0};
+            f = tab + 1;
+            for (unsigned k = 0; k < 2 && f < e; ++k)
+            {
+                while (f < e && *f >= '0' && *f <= '9')
+                    pos[k] = 10 * pos[k] + (*f++ - '0');
+                ++f;
+            }
+            addRecord(index, name, pos[0], pos[1], uOffset + p, uOffset + p + lineLength);
+        }
+        p += lineLength;
+    }
+}
+
+template <typename TValue>
+inline void appendTabixRaw(std::string &out, TValue value)
+{
+    out.append(reinterpret_cast<char const *>(&value), sizeof(TValue));
+}
+
+// write index, offsets are converted to virtual offsets of the closed data file
+inline bool writeTabixIndex(TabixIndex &index, BgzfWriter const &dataWriter, char const * fileName)
+{
+    std::string out("TBI\1", 4);
+    appendTabixRaw(out, (__int32)index.names.size());
+    appendTabixRaw(out, (__int32)0x10000);      // TBX_UCSC: BED coordinates
+    appendTabixRaw(out, (__int32)1);            // col_seq
+    appendTabixRaw(out, (__int32)2);            // col_beg
+    appendTabixRaw(out, (__int32)3);            // col_end
+    appendTabixRaw(out, (__int32)'#');          // meta char
+    appendTabixRaw(out, (__int32)0);            // skip lines
+    __int32 nameLength = 0;
+    for (size_t i = 0; i < index.names.size(); ++i)
+        nameLength += index.names[i].size() + 1;
+    appendTabixRaw(out, nameLength);
+    for (size_t i = 0; i < index.names.size(); ++i)
+        out.append(index.names[i].c_str(), index.names[i].size() + 1);
+
+    for (size_t i = 0; i < index.refs.size(); ++i)
+    {
+        TabixIndexRef &ref = index.refs[i];
+        appendTabixRaw(out, (__int32)ref.bins.size());
+        for (std::map<unsigned, std::vector<std::pair<__uint64, __uint64> > >::const_iterator it = ref.bins.begin(); it != ref.bins.end(); ++it)
+        {
+            appendTabixRaw(out, (__uint32)it->first);
+            appendTabixRaw(out, (__int32)it->second.size());
+            for (size_t c = 0; c < it->second.size(); ++c)
+            {
+                appendTabixRaw(out, getVirtualOffset(dataWriter, it->second[c].first));
+                appendTabixRaw(out, getVirtualOffset(dataWriter, it->second[c].second));
+            }
+        }
+        // windows without records get offset of preceding window
+        appendTabixRaw(out, (__int32)ref.linear.size());
+        __uint64 prev = 0;
+        for (size_t w = 0; w < ref.linear.size(); ++w)
+        {
+            if (ref.linear[w] != std::numeric_limits<__uint64>::max())
+                prev = getVirtualOffset(dataWriter, ref.linear[w]);
+            appendTabixRaw(out, prev);
+        }
+    }
+
+    BgzfWriter writer;
+    if (!open(writer, fileName, 1))
+        return false;
+    write(writer, out.data(), out.size());
+    return close(writer);
+}
+
+#endif
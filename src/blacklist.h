@@ -0,0 +1,201 @@
+// ======================================================================
+// PureCLIP: capturing target-specific protein-RNA interaction footprints
+// ======================================================================
+// Copyright (C) 2017  Sabrina Krakau, Max Planck Institute for Molecular
+// Genetics
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// =======================================================================
+// Author: Sabrina Krakau <krakau@molgen.mpg.de>
+// =======================================================================
+
+
+#ifndef APPS_HMMS_BLACKLIST_H_
+#define APPS_HMMS_BLACKLIST_H_
+
+#include <iostream>
+#include <algorithm>
+#include <limits>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "covariate_index.h"
+
+using namespace seqan;
+
+
+// masked regions (e.g. rRNA, snRNA, mitochondrial genes) by contigId, sorted and merged
+// read starts within are removed right after parsing, before covered intervals are extracted
+struct Blacklist
+{
+    String<String<Pair<unsigned, unsigned> > > contigRegions;
+};
+
+// parse BED file (first three columns), records of contigs not in store are skipped
+template <typename TStore>
+bool loadBlacklist(Blacklist &blacklist, CharString const &fileName, TStore &store, AppOptions &options)
+{
+    typedef StringSet<CharString>   TNameStore;
+
+    clear(blacklist.contigRegions);
+    resize(blacklist.contigRegions, length(store.contigNameStore), Exact());
+
+    int fd = ::open(toCString(fileName), O_RDONLY);
+    if (fd == -1)
+    {
+        std::cerr << "ERROR: Could not open " << fileName << " for reading.\n";
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        ::close(fd);
+        std::cerr << "ERROR: Could not open " << fileName << " for reading.\n";
+        return false;
+    }
+    size_t fileSize = st.st_size;
+    if (fileSize == 0)
+    {
+        ::close(fd);
+        return true;
+    }
+    void * mapped = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED)
+    {
+        std::cerr << "ERROR: Could not read " << fileName << ".\n";
+        return false;
+    }
+
+    NameStoreCache<TNameStore> nameStoreCache(store.contigNameStore);
+    CharString contigName;
+    int contigId = -1;
+    unsigned long lineNo = 0;
+    unsigned long nRecords = 0;
+    char const * it = static_cast<char const *>(mapped);
+    char const * fileEnd = it + fileSize;
+    while (it < fileEnd)
+    {
+        char const * lineEnd = static_cast<char const *>(std::memchr(it, '\n', fileEnd - it));
+        if (lineEnd == NULL) lineEnd = fileEnd;
+        char const * lineBegin = it;
+        it = lineEnd + 1;
+        ++lineNo;
+        if (lineEnd > lineBegin && *(lineEnd - 1) == '\r') --lineEnd;
+        if (lineBegin == lineEnd || *lineBegin == '#' ||
+            (lineEnd - lineBegin >= 5 && std::strncmp(lineBegin, "track", 5) == 0) ||
+            (lineEnd - lineBegin >= 7 && std::strncmp(lineBegin, "browser", 7) == 0))
+            continue;
+
+        char const * fieldBegins[3];
+        char const * fieldEnds[3];
+        if (splitFields(fieldBegins, fieldEnds, 3, lineBegin, lineEnd) < 3)
+        {
+            std::cerr << "ERROR: blacklist BED record in line " << lineNo << " is badly formatted. Ignored.\n";
+            continue;
+        }
+
+        if (length(contigName) != (size_t)(fieldEnds[0] - fieldBegins[0]) ||
+            std::strncmp(toCString(contigName), fieldBegins[0], fieldEnds[0] - fieldBegins[0]) != 0)
+        {
+            contigName = CharString(std::string(fieldBegins[0], fieldEnds[0]));
+            unsigned id;
+            contigId = (getIdByName(id, nameStoreCache, contigName)) ? (int)id : -1;
+        }
+        if (contigId < 0)
+            continue;
+
+        __int32 beginPos;
+        __int32 endPos;
+        if (parseInt(beginPos, fieldBegins[1], fieldEnds[1]) != fieldEnds[1] ||
+            parseInt(endPos, fieldBegins[2], fieldEnds[2]) != fieldEnds[2] ||
+            fieldBegins[1] == fieldEnds[1] || fieldBegins[2] == fieldEnds[2] ||
+            beginPos < 0 || endPos < beginPos)
+        {
+            std::cerr << "ERROR: blacklist BED record in line " << lineNo << " is badly formatted. Ignored.\n";
+            continue;
+        }
+        if (beginPos < endPos)
+            appendValue(blacklist.contigRegions[contigId], Pair<unsigned, unsigned>(beginPos, endPos), Generous());
+        ++nRecords;
+    }
+    munmap(mapped, fileSize);
+
+    // sort and merge overlapping regions
+    for (unsigned contigId = 0; contigId < length(blacklist.contigRegions); ++contigId)
+    {
+        String<Pair<unsigned, unsigned> > &regions = blacklist.contigRegions[contigId];
+        if (empty(regions))
+            continue;
+        std::sort(begin(regions, Standard()), end(regions, Standard()));
+        unsigned j = 0;
+        for (unsigned k = 1; k < length(regions); ++k)
+        {
+            if (regions[k].i1 <= regions[j].i2)
+                regions[j].i2 = std::max(regions[j].i2, regions[k].i2);
+            else
+                regions[++j] = regions[k];
+        }
+        resize(regions, j + 1);
+        shrinkToFit(regions);
+    }
+
+    if (options.verbosity >= 1) std::cout << "Loaded " << nRecords << " blacklist regions of " << fileName << std::endl;
+    return true;
+}
+
+// remove read starts within masked regions, reverse strand observations are stored reversed (contigLength - pos - 1)
+// returns number of removed positions
+inline unsigned maskObservations(ContigObservations &contigObservations, String<Pair<unsigned, unsigned> > const &regions, bool isReverse)
+{
+    if (empty(regions) || empty(contigObservations.positions))
+        return 0;
+    finalize(contigObservations);
+
+    unsigned contigLength = contigObservations.contigLength;
+    String<unsigned> &positions = contigObservations.positions;
+    String<__uint8> &counts = contigObservations.counts;
+    unsigned j = 0;
+    for (unsigned k = 0; k < length(positions); ++k)
+    {
+        unsigned pos = (isReverse) ? contigLength - positions[k] - 1 : positions[k];
+        Pair<unsigned, unsigned> const * r = std::upper_bound(begin(regions, Standard()), end(regions, Standard()), Pair<unsigned, unsigned>(pos, std::numeric_limits<unsigned>::max()));
+        if (r != begin(regions, Standard()) && pos < (r - 1)->i2)    // last region beginning at or before pos
+            continue;
+        positions[j] = positions[k];
+        counts[j] = counts[k];
+        ++j;
+    }
+    unsigned nRemoved = length(positions) - j;
+    resize(positions, j);
+    resize(counts, j);
+    return nRemoved;
+}
+
+template <typename TContigObservations>
+inline void maskObservations(TContigObservations &contigObservationsF, TContigObservations &contigObservationsR, unsigned contigId, Blacklist const &blacklist, AppOptions &options)
+{
+    if (contigId >= length(blacklist.contigRegions))
+        return;
+    unsigned nRemoved = maskObservations(contigObservationsF, blacklist.contigRegions[contigId], false);
+    nRemoved += maskObservations(contigObservationsR, blacklist.contigRegions[contigId], true);
+    if (options.verbosity >= 2 && nRemoved > 0)
+        std::cout << "Masked " << nRemoved << " positions with read starts of contig " << contigId << std::endl;
+}
+
+#endif
@@ -39,7 +39,12 @@
 #include <seqan/modifier.h>
 #include <seqan/bed_io.h>
 
+#include "reference_store.h"
+#include "covariate_index.h"
+#include "covariate_track.h"
+#include "blacklist.h"
 #include "parse_alignments.h"
+#include "count_cache.h"
 #include "hmm_1.h"
 #include "prepro_mle.h"
 
@@ -87,7 +92,7 @@ bool loadIntervals(AppOptions &options, TStore &store)
         appendValue(options.intervals_contigIds, contigId);
         // extract positions
         unsigned i1 = 0;
-        unsigned i2 = length(store.contigStore[contigId].seq);
+        unsigned i2 = getContigLength(store, contigId);
         if (j < length(buffer))
         {
             CharString i1_str;
@@ -116,13 +121,13 @@ bool loadIntervals(AppOptions &options, TStore &store)
 
     if (empty(options.intervals_str))   // use all reference contigs
     {
-        for (unsigned contigId = 0; contigId < length(store.contigStore); ++contigId)
+        for (unsigned contigId = 0; contigId < length(store.contigNameStore); ++contigId)
         {
             appendValue(options.intervals_contigIds, contigId);
             CharString contigName = store.contigNameStore[contigId];
 
             unsigned i1 = 0;
-            unsigned i2 = length(store.contigStore[contigId].seq);
+            unsigned i2 = getContigLength(store, contigId);
             if (options.verbosity >= 2)  std::cout << "contigName: " << contigName << " i1: " << i1 << " i2: " << i2 << std::endl;
 
             String<unsigned> interval;
@@ -165,7 +170,7 @@ bool loadApplyChrs(AppOptions &options, TStore &store)
 
     if (empty(options.applyChr_str))   // use all reference contigs
     {
-        for (unsigned contigId = 0; contigId < length(store.contigStore); ++contigId)
+        for (unsigned contigId = 0; contigId < length(store.contigNameStore); ++contigId)
         {
             if (options.verbosity >= 2) std::cout << "contigName: " << store.contigNameStore[contigId] << std::endl;
             appendValue(options.applyChr_contigIds, contigId);
@@ -177,18 +182,72 @@ bool loadApplyChrs(AppOptions &options, TStore &store)
 
 
 
-template <typename TContigObservations, typename TStore>
-bool loadObservations(TContigObservations &contigObservationsF, TContigObservations &contigObservationsR, unsigned contigId, TStore &store, AppOptions &options)
+// parse chunks of BAM file in parallel, each thread with own BamFileIn
+// counts of each chunk are added to contigObservations[chunk.obsId], which have to be initialized
+template <typename TContigObservations>
+bool parseBamChunks(String<TContigObservations> &contigObservationsF, String<TContigObservations> &contigObservationsR, String<BamChunk> const &chunks, BamIndex<Bai> const &baiIndex, AppOptions &options)
 {
-#ifdef HMM_PROFILE
-    double timeStamp = sysTime();
+    if (options.verbosity >= 2) std::cout << "Parse " << length(chunks) << " chunks of BAM file in parallel ... " << std::endl;
+
+    String<TContigObservations> chunkObservationsF;
+    String<TContigObservations> chunkObservationsR;
+    resize(chunkObservationsF, length(chunks), Exact());
+    resize(chunkObservationsR, length(chunks), Exact());
+    bool stop = false;
+#if HMM_PARALLEL
+    SEQAN_OMP_PRAGMA(parallel num_threads(options.numThreadsBamChunks))
 #endif
+    {
+        BamFileIn inFile;
+        bool opened = open(inFile, toCString(options.bamFileName));
+        if (opened)
+        {
+            BamHeader header;
+            readHeader(header, inFile);
+        }
+        else
+        {
+            SEQAN_OMP_PRAGMA(critical)
+            std::cerr << "ERROR: Could not open " << options.bamFileName << " for reading.\n";
+            stop = true;
+        }
+#if HMM_PARALLEL
+        SEQAN_OMP_PRAGMA(for schedule(dynamic, 1))
+#endif
+        for (unsigned k = 0; k < length(chunks); ++k)
+        {
+            if (!opened)
+                continue;
+            init(chunkObservationsF[k], chunks[k].contigLength);
+            init(chunkObservationsR[k], chunks[k].contigLength);
+            if (!parse_bamChunk(chunkObservationsF[k], chunkObservationsR[k], inFile, baiIndex, chunks[k].rID, chunks[k].beginPos, chunks[k].endPos, chunks[k].chunkBegin, chunks[k].chunkEnd, options))
+                stop = true;
+        }
+    }
+    if (stop) return false;
+
+    // chunks of a contig are ordered, forward counts are appended
+    for (unsigned k = 0; k < length(chunks); ++k)
+    {
+        addCounts(contigObservationsF[chunks[k].obsId], chunkObservationsF[k]);
+        addCounts(contigObservationsR[chunks[k].obsId], chunkObservationsR[k]);
+        clear(chunkObservationsF[k].positions);
+        clear(chunkObservationsF[k].counts);
+        clear(chunkObservationsR[k].positions);
+        clear(chunkObservationsR[k].counts);
+    }
+    return true;
+}
 
+
+// count read starts within [beginPos, endPos) of contig, jumping there using the BAI index
+template <typename TContigObservations, typename TBamIn, typename TStore>
+bool loadObservations(TContigObservations &contigObservationsF, TContigObservations &contigObservationsR, unsigned contigId, unsigned beginPos, unsigned endPos, TBamIn &inFile, TStore &store, AppOptions &options)
+{
     if (options.verbosity >= 2) std::cout << "Parse alignments ... " << std::endl;
 
     // Open BamFileIn for reading.
     if (options.verbosity >= 2) std::cout << "Open Bam and Bai file ... "  << "\n";
-    BamFileIn inFile;
     if (!open(inFile, toCString(options.bamFileName)))
     {
         std::cerr << "ERROR: Could not open " << options.bamFileName << " for reading.\n";
@@ -211,18 +270,257 @@ bool loadObservations(TContigObservations &contigObservationsF, TContigObservati
         return false; 
     }
 
-    resize(contigObservationsF.truncCounts, length(store.contigStore[contigId].seq), 0, Exact());
-    resize(contigObservationsR.truncCounts, length(store.contigStore[contigId].seq), 0, Exact());
+    init(contigObservationsF, getContigLength(store, contigId));
+    init(contigObservationsR, getContigLength(store, contigId));
 
-    parse_bamRegion(contigObservationsF, contigObservationsR, inFile, baiIndex, rID, options);
+    if (options.numThreadsBamChunks > 1)     // split contig into chunks parsed in parallel
+    {
+        String<BamChunk> chunks;
+        __uint64 chunkSize = std::max(getBamRegionSize(baiIndex, rID, beginPos, endPos) / (options.numThreadsBamChunks * 4), (__uint64)1 << 20);
+        appendBamChunks(chunks, baiIndex, 0, rID, getContigLength(store, contigId), beginPos, endPos, chunkSize);
+
+        String<TContigObservations> chunkedF;
+        String<TContigObservations> chunkedR;
+        resize(chunkedF, 1);
+        resize(chunkedR, 1);
+        init(chunkedF[0], getContigLength(store, contigId));
+        init(chunkedR[0], getContigLength(store, contigId));
+        if (!parseBamChunks(chunkedF, chunkedR, chunks, baiIndex, options))
+            return false;
+        swap(contigObservationsF.positions, chunkedF[0].positions);
+        swap(contigObservationsF.counts, chunkedF[0].counts);
+        swap(contigObservationsR.positions, chunkedR[0].positions);
+        swap(contigObservationsR.counts, chunkedR[0].counts);
+    }
+    else
+    {
+        if (!parse_bamRegion(contigObservationsF, contigObservationsR, inFile, baiIndex, rID, beginPos, endPos, options))
+            return false;
+    }
 
     // ATTENTIONE: reverse in-place here to avoid problems for observations datastructures (and use Modifier iterator later within writeStates)  !!!!!!!!
     reverse(contigObservationsR);      
 
     if (options.verbosity >= 2) std::cout << "... observations loaded" << std::endl;
+    return true;
+}
+
+
+template <typename TContigObservations, typename TStore>
+bool loadObservations(TContigObservations &contigObservationsF, TContigObservations &contigObservationsR, unsigned contigId, unsigned beginPos, unsigned endPos, TStore &store, AppOptions &options)
+{
+#ifdef HMM_PROFILE
+    double timeStamp = sysTime();
+#endif
+
+    bool res;
+    if (options.numThreadsBgzf > 1)     // inflate BGZF blocks in parallel
+    {
+        ParallelBamFileIn inFile(options.numThreadsBgzf);
+        res = loadObservations(contigObservationsF, contigObservationsR, contigId, beginPos, endPos, inFile, store, options);
+    }
+    else
+    {
+        BamFileIn inFile;
+        res = loadObservations(contigObservationsF, contigObservationsR, contigId, beginPos, endPos, inFile, store, options);
+    }
+
 #ifdef HMM_PROFILE
     Times::instance().time_loadObservations += (sysTime() - timeStamp);
 #endif
+    return res;
+}
+
+
+// single pass over BAM file: load observations of all contigs used for learning or applying
+// contigObservations are indexed by contigId and shared by learning and applying
+template <typename TContigObservations, typename TBamIn, typename TStore>
+bool loadAllObservations(String<TContigObservations> &contigObservationsF, String<TContigObservations> &contigObservationsR, TBamIn &inFile, TStore &store, AppOptions &options)
+{
+    if (options.verbosity >= 1) std::cout << "Parse alignments of all contigs in single pass ... " << std::endl;
+
+    if (!open(inFile, toCString(options.bamFileName)))
+    {
+        std::cerr << "ERROR: Could not open " << options.bamFileName << " for reading.\n";
+        return false;
+    }
+    BamHeader header;
+    readHeader(header, inFile);
+
+    resize(contigObservationsF, length(store.contigNameStore), Exact());
+    resize(contigObservationsR, length(store.contigNameStore), Exact());
+
+    // map BAM rIDs to contigIds, only for contigs used for learning or applying
+    String<int> rIdToContigId;
+    resize(rIdToContigId, length(contigNames(context(inFile))), -1, Exact());
+    String<unsigned> contigIds = options.intervals_contigIds;
+    append(contigIds, options.applyChr_contigIds);
+    for (unsigned i = 0; i < length(contigIds); ++i)
+    {
+        unsigned contigId = contigIds[i];
+        if (!empty(contigObservationsF[contigId]))
+            continue;
+
+        // Translate from contig name to rID.
+        int rID = 0;
+        if (!getIdByName(rID, contigNamesCache(context(inFile)), store.contigNameStore[contigId]))
+        {
+            std::cerr << "ERROR: Contig " << store.contigNameStore[contigId] << " not known.\n";
+            return false;
+        }
+        rIdToContigId[rID] = contigId;
+        init(contigObservationsF[contigId], getContigLength(store, contigId));
+        init(contigObservationsR[contigId], getContigLength(store, contigId));
+    }
+
+    if (options.numThreadsBamChunks > 1)     // split contigs into chunks parsed in parallel
+    {
+        BamIndex<Bai> baiIndex;
+        if (!open(baiIndex, toCString(options.baiFileName)))
+        {
+            std::cerr << "ERROR: Could not read BAI index file " << options.baiFileName << "\n";
+            return false;
+        }
+        __uint64 totalSize = 0;
+        for (unsigned rID = 0; rID < length(rIdToContigId); ++rID)
+            if (rIdToContigId[rID] >= 0)
+                totalSize += getBamRegionSize(baiIndex, rID, 0, contigObservationsF[rIdToContigId[rID]].contigLength);
+        __uint64 chunkSize = std::max(totalSize / (options.numThreadsBamChunks * 4), (__uint64)1 << 20);
+
+        String<BamChunk> chunks;
+        for (unsigned rID = 0; rID < length(rIdToContigId); ++rID)
+            if (rIdToContigId[rID] >= 0)
+                appendBamChunks(chunks, baiIndex, rIdToContigId[rID], rID, contigObservationsF[rIdToContigId[rID]].contigLength, 0, contigObservationsF[rIdToContigId[rID]].contigLength, chunkSize);
+        if (!parseBamChunks(contigObservationsF, contigObservationsR, chunks, baiIndex, options))
+            return false;
+    }
+    else
+    {
+        if (!parse_bamAll(contigObservationsF, contigObservationsR, rIdToContigId, inFile, options))
+            return false;
+    }
+
+    // ATTENTIONE: reverse in-place here to avoid problems for observations datastructures (and use Modifier iterator later within writeStates)  !!!!!!!!
+    for (unsigned contigId = 0; contigId < length(contigObservationsR); ++contigId)
+        reverse(contigObservationsR[contigId]);
+
+    if (options.verbosity >= 2) std::cout << "... observations of all contigs loaded" << std::endl;
+    return true;
+}
+
+
+template <typename TContigObservations, typename TStore>
+bool loadAllObservations(String<TContigObservations> &contigObservationsF, String<TContigObservations> &contigObservationsR, TStore &store, AppOptions &options)
+{
+#ifdef HMM_PROFILE
+    double timeStamp = sysTime();
+#endif
+
+    bool res;
+    if (options.numThreadsBgzf > 1)     // inflate BGZF blocks in parallel
+    {
+        ParallelBamFileIn inFile(options.numThreadsBgzf);
+        res = loadAllObservations(contigObservationsF, contigObservationsR, inFile, store, options);
+    }
+    else
+    {
+        BamFileIn inFile;
+        res = loadAllObservations(contigObservationsF, contigObservationsR, inFile, store, options);
+    }
+
+#ifdef HMM_PROFILE
+    Times::instance().time_loadObservations += (sysTime() - timeStamp);
+#endif
+    return res;
+}
+
+
+// covered interval in forward strand coordinates, for sorted sweep over control BAM file
+struct CoveredInterval
+{
+    unsigned contigId;
+    unsigned beginPos;
+    unsigned endPos;
+    unsigned s;
+    unsigned i;
+
+    bool operator<(CoveredInterval const &other) const
+    {
+        return contigId < other.contigId || (contigId == other.contigId && beginPos < other.beginPos);
+    }
+};
+
+// sweep control BAM file once per contig over the range spanned by all covered intervals,
+// read starts are distributed to intervals afterwards
+template <typename TBamIn, typename TStore, typename TOptions>
+bool loadBAMCovariatesSweep(Data &data, TBamIn &inFile, BamIndex<Bai> const &baiIndex, TStore &store, TOptions &options)
+{
+    String<CoveredInterval> intervals;
+    for (unsigned s = 0; s < 2; ++s)
+    {
+        for (unsigned i = 0; i < length(data.setObs[s]); ++i)
+        {
+            CoveredInterval interval;
+            interval.contigId = data.setObs[s][i].contigId;
+            if (s == 0)
+                interval.beginPos = data.setPos[s][i];
+            else
+                interval.beginPos = getContigLength(store, interval.contigId) - (data.setObs[s][i].length() + data.setPos[s][i]);
+            interval.endPos = interval.beginPos + data.setObs[s][i].length();
+            interval.s = s;
+            interval.i = i;
+            appendValue(intervals, interval);
+        }
+    }
+    std::sort(begin(intervals, Standard()), end(intervals, Standard()));
+
+    unsigned k = 0;
+    while (k < length(intervals))
+    {
+        unsigned contigId = intervals[k].contigId;
+        unsigned sweepBegin = intervals[k].beginPos;
+        unsigned sweepEnd = intervals[k].endPos;
+        unsigned kEnd = k;
+        while (kEnd < length(intervals) && intervals[kEnd].contigId == contigId)
+        {
+            sweepEnd = std::max(sweepEnd, intervals[kEnd].endPos);
+            ++kEnd;
+        }
+
+        // Translate from contig name to rID.
+        int rID = 0;
+        if (!getIdByName(rID, contigNamesCache(context(inFile)), store.contigNameStore[contigId]))
+        {
+            std::cerr << "ERROR: Contig " << store.contigNameStore[contigId] << " not known.\n";
+            return false; 
+        }
+        ContigObservations contigObservationsF;
+        ContigObservations contigObservationsR;
+        init(contigObservationsF, getContigLength(store, contigId));
+        init(contigObservationsR, getContigLength(store, contigId));
+        if (!parse_bamChunk(contigObservationsF, contigObservationsR, inFile, baiIndex, rID, sweepBegin, sweepEnd, 0, sweepEnd, options))
+            return false;
+
+        for (; k < kEnd; ++k)
+        {
+            CoveredInterval &interval = intervals[k];
+            String<__uint8> truncCounts;
+            if (interval.s == 0)
+            {
+                getTruncCounts(truncCounts, contigObservationsF, interval.beginPos, interval.endPos);
+            }
+            else
+            {
+                getTruncCounts(truncCounts, contigObservationsR, interval.beginPos, interval.endPos);
+                // reverse
+                reverse(truncCounts);
+            }
+            // compute KDEs
+            data.setObs[interval.s][interval.i].computeKDEs(truncCounts, options);
+        }
+    }
+
+    if (options.verbosity >= 2) std::cout << "... BAM covariates loaded" << std::endl;
     return true;
 }
 
@@ -251,6 +549,9 @@ bool loadBAMCovariates(Data &data, TStore &store, TOptions &options)
     }
 
     if (options.verbosity >= 1) std::cout << "  Parse input BAM, get truncCounts, compute KDEs ... " << std::endl;
+    if (options.sweepInputBam)
+        return loadBAMCovariatesSweep(data, inFile, baiIndex, store, options);
+
     for (unsigned s = 0; s < 2; ++s)
     {
         for (unsigned i = 0; i < length(data.setObs[s]); ++i)
@@ -272,7 +573,7 @@ bool loadBAMCovariates(Data &data, TStore &store, TOptions &options)
             }
             else
             {
-                unsigned beginPos = length(store.contigStore[data.setObs[s][i].contigId].seq) - (data.setObs[s][i].length() + data.setPos[s][i]);
+                unsigned beginPos = getContigLength(store, data.setObs[s][i].contigId) - (data.setObs[s][i].length() + data.setPos[s][i]);
                 unsigned endPos = beginPos + data.setObs[s][i].length();
 
                 parse_bamRegion(truncCounts, inFile, baiIndex, rID, beginPos, endPos, false, options);
@@ -289,9 +590,48 @@ bool loadBAMCovariates(Data &data, TStore &store, TOptions &options)
 }
 
 
+// pureclip ctrlkde: KDEs of control BAM file (options.bamFileName) for all contigs, written into binary track
+// used with -is instead of -ibam/-ibai, log-transformed on load
+template <typename TStore>
+bool writeControlKdeTrack(CharString const &fileName, TStore &store, AppOptions &options)
+{
+    BamFileIn inFile;
+    if (!open(inFile, toCString(options.bamFileName)))
+    {
+        std::cerr << "ERROR: Could not open " << options.bamFileName << " for reading.\n";
+        return false;
+    }
+    BamHeader header;
+    readHeader(header, inFile);
+
+    String<CovariateTrackStrandData> strandData;
+    resize(strandData, 2 * length(store.contigNameStore));
+    for (unsigned contigId = 0; contigId < length(store.contigNameStore); ++contigId)
+    {
+        int rID = 0;
+        if (!getIdByName(rID, contigNamesCache(context(inFile)), store.contigNameStore[contigId]))
+        {
+            if (options.verbosity >= 2) std::cout << "Contig " << store.contigNameStore[contigId] << " not contained in control BAM file, skipped." << std::endl;
+            continue;
+        }
+        if (options.verbosity >= 1) std::cout << "Compute KDEs of control reads for contig " << store.contigNameStore[contigId] << " ... " << std::endl;
+
+        ContigObservations contigObservationsF;
+        ContigObservations contigObservationsR;
+        if (!loadObservations(contigObservationsF, contigObservationsR, contigId, 0, getContigLength(store, contigId), store, options))
+            return false;
+        reverse(contigObservationsR);       // forward strand coordinates
+
+        computeContigKDEs(strandData[2 * contigId].runs, strandData[2 * contigId].values, contigObservationsF, options);
+        computeContigKDEs(strandData[2 * contigId + 1].runs, strandData[2 * contigId + 1].values, contigObservationsR, options);
+    }
+    return writeCovariateTrack(fileName, strandData, store, 0, 0, options.bandwidth, getKdeKernelId(options), (__uint32)options.kdeEngine);
+}
+
 // precomputed 
+// fill covariates of contig from binary track or its slice of the covariate index
 template <typename TStore>
-bool loadCovariates(String<double> &contigCovsF, String<double> &contigCovsR, unsigned contigId, TStore &store, AppOptions &options)
+bool loadCovariates(String<double> &contigCovsF, String<double> &contigCovsR, unsigned contigId, CovariateSource const &covSource, TStore &store, AppOptions &options)
 {   
     if (!empty(options.rpkmFileName)) 
     {
@@ -299,67 +639,58 @@ bool loadCovariates(String<double> &contigCovsF, String<double> &contigCovsR, un
         if (options.useLogRPKM) 
             minRPKM = options.minRPKMtoFit - 1.0; 
         
-        resize(contigCovsF, length(store.contigStore[contigId].seq), minRPKM, Exact());
-        resize(contigCovsR, length(store.contigStore[contigId].seq), minRPKM, Exact());
+        resize(contigCovsF, getContigLength(store, contigId), minRPKM, Exact());
+        resize(contigCovsR, getContigLength(store, contigId), minRPKM, Exact());
 
-        if (options.verbosity >= 1) std::cout << "Parse covariates ... input signal" << std::endl;
-        BedFileIn bedIn(toCString(options.rpkmFileName));
-        BedRecord<Bed6> bedRecord;      
-        while (!atEnd(bedIn))
+        if (options.verbosity >= 2) std::cout << "Load covariates ... input signal" << std::endl;
+        if (covSource.isTrack)
         {
-            try
-            {
-                readRecord(bedRecord, bedIn);
-            }
-            catch (ParseError const & e)
-            {
-                std::cerr << "ERROR: input BED record is badly formatted. " << e.what() << "\n";
-            }
-            catch (IOError const & e)
-            {
-                std::cerr << "ERROR: could not copy input BED record. " << e.what() << "\n";
-            } 
-
-            if (bedRecord.ref == store.contigNameStore[contigId])   
+            for (unsigned s = 0; s < 2; ++s)
             {
-               if (bedRecord.strand == '+')
-               {
-                    std::stringstream ss(toCString(bedRecord.score)); 
-                    double score;
-                    ss >> score;
-                    if (options.useLogRPKM  && score > 0.0)
-                        score = log(score);
-                    else if (options.useLogRPKM)
-                        score = minRPKM;
-
-                    for (int i = bedRecord.beginPos; i < bedRecord.endPos; ++i)
+                CovariateTrackBlock const * block = getCovariateTrackBlock(covSource.track, contigId, s);
+                if (block == NULL)
+                    break;
+                String<double> &contigCovs = (s == 0) ? contigCovsF : contigCovsR;
+                unsigned k = 0;
+                for (unsigned r = 0; r < block->nRuns; ++r)
+                {
+                    unsigned runBegin, runEnd;
+                    getCovariateTrackRun(runBegin, runEnd, covSource.track, *block, r);
+                    for (unsigned i = runBegin; i < runEnd; ++i, ++k)
                     {
-                        if (contigCovsF[i] == minRPKM)
-                            contigCovsF[i] = score;
-                        else
-                            contigCovsF[i] = std::max(score, contigCovsF[i]);
+                        double score = getCovariateTrackValue(covSource.track, *block, k);
+                        if (options.useLogRPKM  && score > 0.0)
+                            score = log(score);
+                        else if (options.useLogRPKM)
+                            score = minRPKM;
+                        if (i < length(contigCovs))
+                            contigCovs[i] = score;
                     }
-               }
-               else
-               {
-                    std::stringstream ss(toCString(bedRecord.score)); 
-                    double score;
-                    ss >> score;
-                    if (options.useLogRPKM && score > 0.0)
-                        score = log(score);
-                    else if (options.useLogRPKM)
-                        score = minRPKM;
-
-                    for (int i = bedRecord.beginPos; i < bedRecord.endPos; ++i)
-                    {
-                         if (contigCovsR[i] == minRPKM)
-                            contigCovsR[i] = score;
-                        else
-                            contigCovsR[i] = std::max(score, contigCovsR[i]);
-                   }
-               }
+                }
             }
-        } 
+        }
+        else
+        {
+            String<CovariateRecord> const &records = covSource.index.contigRecords[contigId];
+            for (unsigned r = 0; r < length(records); ++r)
+            {
+                double score = records[r].score;
+                if (options.useLogRPKM  && score > 0.0)
+                    score = log(score);
+                else if (options.useLogRPKM)
+                    score = minRPKM;
+
+                String<double> &contigCovs = (records[r].strand == '+') ? contigCovsF : contigCovsR;
+                int endPos = std::min(records[r].endPos, (__int32)length(contigCovs));
+                for (int i = std::max(records[r].beginPos, (__int32)0); i < endPos; ++i)
+                {
+                    if (contigCovs[i] == minRPKM)
+                        contigCovs[i] = score;
+                    else
+                        contigCovs[i] = std::max(score, contigCovs[i]);
+                }
+            } 
+        }
 
         // ATTENTIONE: reverse in-place here to avoid problems for observations datastructures (and use Modifier iterator later within writeStates)  !!!!!!!!
         reverse(contigCovsR);      
@@ -370,72 +701,77 @@ bool loadCovariates(String<double> &contigCovsF, String<double> &contigCovsR, un
 }
 
 
+// rasterize motif score intervals of contig from binary track or its slice of the motif covariate index
+// if motif intervals overlap, the highest score is kept
 template <typename TStore>
-bool loadMotifCovariates(String<String<float> > &contigCovs, String<String<char> > &motifIds, unsigned contigId, TStore &store, AppOptions &options)
+bool loadMotifCovariates(String<String<float> > &contigCovs, String<String<char> > &motifIds, unsigned contigId, CovariateSource const &motifSource, TStore &store, AppOptions &options)
 {   
     
     resize(contigCovs, 2, Exact());
     resize(motifIds, 2, Exact());
     for (unsigned s = 0; s < 2; ++s)
     {
-        resize(contigCovs[s], length(store.contigStore[contigId].seq), 0.0, Exact());
-        resize(motifIds[s], length(store.contigStore[contigId].seq), 0, Exact());
+        resize(contigCovs[s], getContigLength(store, contigId), 0.0, Exact());
+        resize(motifIds[s], getContigLength(store, contigId), 0, Exact());
     }
 
     if (!empty(options.fimoFileName)) 
     {
-        if (options.verbosity >= 2) std::cout << "Parse covariates ... fimo scores for input motifs" << std::endl;
-        BedFileIn bedIn(toCString(options.fimoFileName));
-        BedRecord<Bed6> bedRecord;      
-        while (!atEnd(bedIn))
+        if (options.verbosity >= 2) std::cout << "Load covariates ... fimo scores for input motifs" << std::endl;
+        if (motifSource.isTrack)
         {
-            try
-            {
-                readRecord(bedRecord, bedIn);
-            }
-            catch (ParseError const & e)
-            {
-                std::cerr << "ERROR: input BED record is badly formatted. " << e.what() << "\n";
-            }
-            catch (IOError const & e)
-            {
-                std::cerr << "ERROR: could not copy input BED record. " << e.what() << "\n";
-            } 
-
-            if (bedRecord.ref == store.contigNameStore[contigId])   
+            for (unsigned s = 0; s < 2; ++s)
             {
-                std::stringstream ss(toCString(bedRecord.score)); 
-                double score;
-                ss >> score;
-
-                // assume only one motif with one score for each position!
-                // assume id 1-based
-                unsigned id = atoi(toCString(bedRecord.name)) - 1;     
-                if (id < options.nInputMotifs)
+                CovariateTrackBlock const * block = getCovariateTrackBlock(motifSource.track, contigId, s);
+                if (block == NULL)
+                    break;
+                unsigned k = 0;
+                for (unsigned r = 0; r < block->nRuns; ++r)
                 {
-                    if (bedRecord.strand == '+')
+                    unsigned runBegin, runEnd;
+                    getCovariateTrackRun(runBegin, runEnd, motifSource.track, *block, r);
+                    for (unsigned t = runBegin; t < runEnd; ++t, ++k)
                     {
-                        if (bedRecord.beginPos < (int)length(contigCovs[0]))
+                        // assume id 1-based
+                        unsigned id = getCovariateTrackMotifId(motifSource.track, *block, k) - 1;
+                        float score = getCovariateTrackValue(motifSource.track, *block, k);
+                        if (id < options.nInputMotifs && score > 0.0 && t < length(contigCovs[s]))
                         {
-                            contigCovs[0][bedRecord.beginPos] = std::max(score, 0.0);         // ignore negative scores for the moment
-                            motifIds[0][bedRecord.beginPos] = id;
+                            contigCovs[s][t] = score;
+                            motifIds[s][t] = id;
                         }
-                        else
-                            std::cout << "Warning: beginPos of fimo score is not within contig! Ignored. (contigName: " << bedRecord.ref << ", beginPos: " << bedRecord.beginPos << ")" << std::endl;
                     }
-                    else
+                }
+            }
+        }
+        else
+        {
+            String<CovariateRecord> const &records = motifSource.index.contigRecords[contigId];
+            for (unsigned r = 0; r < length(records); ++r)
+            {
+                // assume id 1-based
+                unsigned id = records[r].id - 1;     
+                if (id >= options.nInputMotifs)
+                    continue;
+
+                unsigned s = (records[r].strand == '+') ? 0 : 1;
+                if (records[r].beginPos >= (int)length(contigCovs[s]))
+                {
+                    std::cout << "Warning: beginPos of fimo score is not within contig! Ignored. (contigName: " << store.contigNameStore[contigId] << ", beginPos: " << records[r].beginPos << ")" << std::endl;
+                    continue;
+                }
+                float score = std::max(records[r].score, 0.0);         // ignore negative scores for the moment
+                int endPos = std::min(records[r].endPos, (__int32)length(contigCovs[s]));
+                for (int t = std::max(records[r].beginPos, (__int32)0); t < endPos; ++t)
+                {
+                    if (score > contigCovs[s][t])
                     {
-                        if (bedRecord.beginPos < (int)length(contigCovs[1]))
-                        {
-                            contigCovs[1][bedRecord.beginPos] = std::max(score, 0.0);
-                            motifIds[1][bedRecord.beginPos] = id;
-                        }
-                        else
-                            std::cout << "Warning: beginPos of fimo score is not within contig! Ignored. (contigName: " << bedRecord.ref << ", beginPos: " << bedRecord.beginPos << ")" << std::endl;
+                        contigCovs[s][t] = score;
+                        motifIds[s][t] = id;
                     }
                 }
-            }
-        } 
+            } 
+        }
 
         // ATTENTIONE: reverse in-place here to avoid problems for observations datastructures (and use Modifier iterator later within writeStates)  !!!!!!!!
         reverse(contigCovs[1]);    
@@ -558,6 +894,8 @@ void extractCoveredIntervals(Data &data,
 
     unsigned countPolyAs = 0;
     unsigned countPolyTs = 0;
+    unsigned countSaturated = 0;
+    Dna5String seq;                                 // reference sequence of covered interval
     // FORWARD                                      // TODO merge code F and R!
     unsigned c1;                                   // covered interval begin
     unsigned c2;                                   // covered interval end
@@ -569,7 +907,7 @@ void extractCoveredIntervals(Data &data,
     while (i < i2)
     {
 
-        while (i < i2 && contigObservationsF.truncCounts[i] == 0) ++i;    // find begin of covered interval     
+        i = nextCoveredPos(contigObservationsF, i, i2);    // find begin of covered interval     
         c1 = i;
         if (((int)c1 - (int)options.intervalOffset) > (int)prev_c2)    // if gap bigger than intervalOffset, shift c1 to left
         {
@@ -585,7 +923,7 @@ void extractCoveredIntervals(Data &data,
             ++i;
             if (i >= i2) break;
                 
-            while (i < i2 && contigObservationsF.truncCounts[i] > 0) ++i;      // find end of covered interval
+            i = coveredRunEnd(contigObservationsF, i, i2);      // find end of covered interval
             c2 = std::min(i + options.intervalOffset, i2);
             prev_c2 = c2;
             continue;
@@ -601,12 +939,22 @@ void extractCoveredIntervals(Data &data,
 
         if (i >= i2) break;
             
-        while (i < i2 && contigObservationsF.truncCounts[i] > 0) ++i;      // find end of covered interval
+        i = coveredRunEnd(contigObservationsF, i, i2);      // find end of covered interval
         c2 = std::min(i + options.intervalOffset, i2);
 
+        if (getMaxCount(contigObservationsF, c1, c2) > options.maxTruncCount)   // discard before counts and KDEs are computed
+        {
+            if (options.verbosity >= 2) std::cout << "WARNING: Discard interval " << c1 << "-" << c2 << " due to position with more than " << options.maxTruncCount << " read starts." << std::endl;
+            ++countSaturated;
+            prev_dis = true;
+            prev_c2 = c2;
+            continue;
+        }
+        if (excludePolyA || excludePolyT)
+            readContigRegion(seq, store, contigId, c1, c2);
         if (excludePolyA) // check if covered interval contains internal polyA  
         {
-            if (checkForPolyA(infix(store.contigStore[contigId].seq, c1, c2), options)) 
+            if (checkForPolyA(seq, options)) 
             {
                 ++countPolyAs;
                 prev_dis = true;
@@ -616,7 +964,7 @@ void extractCoveredIntervals(Data &data,
         }
         if (excludePolyT) // check for polyT (polyU) 
         {
-            if (checkForPolyT(infix(store.contigStore[contigId].seq, c1, c2), options)) 
+            if (checkForPolyT(seq, options)) 
             {
                 ++countPolyTs;
                 prev_dis = true;
@@ -630,7 +978,7 @@ void extractCoveredIntervals(Data &data,
         // create observations for current covered interval
         //std::cout << "   parsed interval: " << c1 << " - " << c2 << " ..."  << std::endl;
         Observations observations;
-        observations.truncCounts = infix(contigObservationsF.truncCounts, c1, c2);
+        getTruncCounts(observations.truncCounts, contigObservationsF, c1, c2);
         observations.contigId = contigId;
         if (!empty(options.rpkmFileName))
         {
@@ -645,8 +993,8 @@ void extractCoveredIntervals(Data &data,
         appendValue(data.setPos[0], c1, Generous());
     } 
     // REVERSE 
-    unsigned i1_R = length(contigObservationsR.truncCounts) - i2;
-    unsigned i2_R = length(contigObservationsR.truncCounts) - i1;
+    unsigned i1_R = contigObservationsR.contigLength - i2;
+    unsigned i2_R = contigObservationsR.contigLength - i1;
     i = i1_R;
     prev_c1 = i1_R;
     prev_c2 = i1_R;
@@ -654,7 +1002,7 @@ void extractCoveredIntervals(Data &data,
     if (options.verbosity >= 2) std::cout << "R: Parse covered intervals and get observations  ..." << "i1_R: " << i1_R << " i2_R: " << i2_R << std::endl;
     while (i < i2_R)
     {
-        while (i < i2_R && contigObservationsR.truncCounts[i] == 0) ++i;    // find begin of covered interval
+        i = nextCoveredPos(contigObservationsR, i, i2_R);    // find begin of covered interval
         c1 = i;
         if (((int)c1 - (int)options.intervalOffset) > (int)prev_c2)    // if gap bigger than intervalOffset, shift c1 to left
         {
@@ -670,7 +1018,7 @@ void extractCoveredIntervals(Data &data,
             ++i;
             if (i >= i2_R) break;
                 
-            while (i < i2_R && contigObservationsR.truncCounts[i] > 0) ++i;      // find end of covered interval
+            i = coveredRunEnd(contigObservationsR, i, i2_R);      // find end of covered interval
             c2 = std::min(i + options.intervalOffset, i2_R);
             prev_c2 = c2;
             continue;
@@ -686,12 +1034,22 @@ void extractCoveredIntervals(Data &data,
 
         if (i >= i2_R) break;
 
-        while (i < i2_R && contigObservationsR.truncCounts[i] > 0) ++i;      // find end of covered interval
+        i = coveredRunEnd(contigObservationsR, i, i2_R);      // find end of covered interval
         c2 = std::min(i + options.intervalOffset, i2_R);
 
+        if (getMaxCount(contigObservationsR, c1, c2) > options.maxTruncCount)
+        {
+            if (options.verbosity >= 2) std::cout << "WARNING: Discard interval " << (contigObservationsR.contigLength - c2) << "-" << (contigObservationsR.contigLength - c1) << " (R) due to position with more than " << options.maxTruncCount << " read starts." << std::endl;
+            ++countSaturated;
+            prev_dis = true;
+            prev_c2 = c2;
+            continue;
+        }
+        if (excludePolyA || excludePolyT)
+            readContigRegion(seq, store, contigId, (int)getContigLength(store, contigId)-(int)c2-1, (int)getContigLength(store, contigId)-(int)c1-1);
         if (excludePolyA) // check if covered interval contains internal polyA  
         {
-            if (checkForPolyT(infix(store.contigStore[contigId].seq, length(store.contigStore[contigId].seq)-c2-1, length(store.contigStore[contigId].seq)-c1-1), options)) 
+            if (checkForPolyT(seq, options)) 
             {
                 ++countPolyAs;
                 prev_dis = true;
@@ -701,7 +1059,7 @@ void extractCoveredIntervals(Data &data,
         }
         if (excludePolyT) // check for polyT (polyU)  
         {
-            if (checkForPolyA(infix(store.contigStore[contigId].seq, length(store.contigStore[contigId].seq)-c2-1, length(store.contigStore[contigId].seq)-c1-1), options)) 
+            if (checkForPolyA(seq, options)) 
             {
                 ++countPolyTs;
                 prev_dis = true;
@@ -714,7 +1072,7 @@ void extractCoveredIntervals(Data &data,
 
         // create observations for current covered interval
         Observations observations; 
-        observations.truncCounts = infix(contigObservationsR.truncCounts, c1, c2);
+        getTruncCounts(observations.truncCounts, contigObservationsR, c1, c2);
         observations.contigId = contigId;
         if (options.useFimoScore)
         {
@@ -734,61 +1092,81 @@ void extractCoveredIntervals(Data &data,
     {
         std::cout << " Excluded " << countPolyAs << " covered intervals from analysis because of internal polyA sites! " << std::endl;
         std::cout << " Excluded " << countPolyTs << " covered intervals from analysis because of internal polyU sites! " << std::endl;
+        std::cout << " Excluded " << countSaturated << " covered intervals from analysis because of positions with more than " << options.maxTruncCount << " read starts! " << std::endl;
         std::cout << " No. of remaining intervals: " << (length(data.setObs[0]) + length(data.setObs[1])) << "   F: " << length(data.setObs[0]) << "   R: " << length(data.setObs[1]) << std::endl;
     }
-    cleanCoveredIntervals(data, length(store.contigStore[contigId].seq), options);
+    cleanCoveredIntervals(data, getContigLength(store, contigId), options);
     if (options.verbosity >= 2) 
         std::cout << " No. of remaining intervals after cleaning up: " << (length(data.setObs[0]) + length(data.setObs[1])) << std::endl;
 }
 
 
+// online statistics for simple linear regression (Welford), mergeable (Chan et al.)
+struct SlrStats
+{
+    double n;
+    double meanX;
+    double meanY;
+    double m2X;         // sum of squared deviations of x
+    double cXY;         // sum of co-deviations
+
+    SlrStats() : n(0.0), meanX(0.0), meanY(0.0), m2X(0.0), cXY(0.0) {}
+};
+
+inline void add(SlrStats &stats, double x, double y)
+{
+    stats.n += 1.0;
+    double dX = x - stats.meanX;
+    stats.meanX += dX / stats.n;
+    stats.meanY += (y - stats.meanY) / stats.n;
+    stats.m2X += dX * (x - stats.meanX);
+    stats.cXY += dX * (y - stats.meanY);
+}
+
+inline void merge(SlrStats &stats, SlrStats const &other)
+{
+    if (other.n == 0.0)
+        return;
+    double n = stats.n + other.n;
+    double dX = other.meanX - stats.meanX;
+    double dY = other.meanY - stats.meanY;
+    double f = stats.n * other.n / n;
+    stats.meanX += dX * other.n / n;
+    stats.meanY += dY * other.n / n;
+    stats.m2X += other.m2X + dX * dX * f;
+    stats.cXY += other.cXY + dX * dY * f;
+    stats.n = n;
+}
+
 // simple linear regression: kde -> N (window count)
+// single pass per interval in parallel, interval statistics merged in fixed order (deterministic)
 template <typename TOptions>
 void computeSLR(double &b0, double &b1, Data &data, TOptions &options) // TODO check result
 {
     unsigned w_50 = floor((double)options.binSize/2.0 - 0.1);    // binSize should be odd
 
-    String<double> kdes;
-    String<unsigned> counts;
-    for (unsigned s = 0; s < 2; ++s)
-    {
-        for (unsigned i = 0; i < length(data.setObs[s]); ++i)
-        {
-            // KDE - window truncCount relationship 
-            for (unsigned t = 0; t < data.setObs[s][i].length(); ++t)
-            {
-                unsigned sum = 0;
-                for (unsigned j = std::max((int)t - (int)w_50, (int)0); (j < data.setObs[s][i].length()) && (j <= t + w_50); ++j)  // inefficient... update on the fly
-                    sum += data.setObs[s][i].truncCounts[j];
-                
-                appendValue(kdes, data.setObs[s][i].kdes[t], Generous());
-                appendValue(counts, sum, Generous());
-                // = std::max(sum, (unsigned)1);  // TODO avoid becoming 0 !
-                //out << setObsF[i].kdes[t] << '\t' << sum << '\n';
-            }
-        }
-    }
     std::cout << "  Compute SLR ... " << std::endl;
-    double mean_kde = 0.0;
-    double mean_count = 0.0;
-    for (unsigned i = 0; i < length(kdes); ++i)
-    {
-        mean_kde += kdes[i];
-        mean_count += counts[i];
-    }
-    mean_kde = mean_kde/(double)length(kdes);
-    mean_count = (double)mean_count/(double)length(counts);
-
-    double sum1 = 0;
-    double sum2 = 0;
-    for (unsigned i = 0; i < length(kdes); ++i)
+    String<SlrStats> intervalStats;
+    resize(intervalStats, length(data.setObs[0]) + length(data.setObs[1]), Exact());
+#if HMM_PARALLEL
+    SEQAN_OMP_PRAGMA(parallel for schedule(dynamic, 64) num_threads(options.numThreads))
+#endif
+    for (unsigned k = 0; k < length(intervalStats); ++k)
     {
-       sum1 += (kdes[i] - mean_kde) * ((double)counts[i] - mean_count);
-       sum2 += pow((kdes[i] - mean_kde), 2);
+        unsigned s = (k < length(data.setObs[0])) ? 0 : 1;
+        unsigned i = (s == 0) ? k : k - length(data.setObs[0]);
+        // KDE - window truncCount relationship 
+        String<unsigned> sums;
+        getWindowCounts(sums, data.setObs[s][i].truncCounts, w_50);
+        for (unsigned t = 0; t < data.setObs[s][i].length(); ++t)
+            add(intervalStats[k], data.setObs[s][i].kdes[t], (double)sums[t]);
     }
+    SlrStats stats;
+    for (unsigned k = 0; k < length(intervalStats); ++k)
+        merge(stats, intervalStats[k]);
 
-    b1 = sum1 / sum2;
-    b0 = mean_count - b1*mean_kde;
+    b1 = stats.cXY / stats.m2X;
+    b0 = stats.meanY - b1*stats.meanX;
 
     if (options.verbosity >= 2) std::cout << "Simple linear regression (count <- kde): b0 = " << b0 << " and b1 = " << b1 << " ." << std::endl;
 }
@@ -918,33 +1296,92 @@ bool applyHMM(Data &data,
 }
 
 
-inline
-const char * myTempFileName(std::string const suffix = "", std::string const tempPath = "")
+// crosslink sites and binding regions of one contig in BED format
+inline void formatSites(std::string &sites, std::string &regions, Data &data, ReferenceStore &store, unsigned contigId, AppOptions &options)
 {
-    if (mkdir(tempPath.c_str(), 0777) == -1)
+    BedWriter outBed;
+    open(outBed, sites);
+    writeStates(outBed, data, store, contigId, options);
+    close(outBed);
+    if (!empty(options.outRegionsFileName))
     {
-        if(errno == EEXIST ) {
-            //std::cout << "Directory already exists " << std::endl;
-        } else {
-            std::cerr << tempPath << std::endl;
-            throw std::runtime_error("ERROR: Could not create directory");
-        }
+        BedWriter outBed2;
+        open(outBed2, regions);
+        writeRegions(outBed2, data, store, contigId, options);
+        close(outBed2);
     }
+}
 
-    static char fileNameBuffer[1000];
-    strcpy(fileNameBuffer, (tempPath + "PURECLIP.XXXXXX" + suffix).c_str());
+// round trip (debug builds): recall from written posterior block has to reproduce sites and regions of this run
+inline bool verifyPosteriorBlock(std::string const &posteriors, std::string const &sites, std::string const &regions, ReferenceStore &store, unsigned contigId, AppOptions &options)
+{
+    if (posteriors.empty())
+        return sites.empty() && regions.empty();
+    Data data;
+    if (!loadPosteriorBlock(data, posteriors.data(), posteriors.size(), contigId))
+        return false;
+    std::string recalledSites;
+    std::string recalledRegions;
+    formatSites(recalledSites, recalledRegions, data, store, contigId, options);
+    return recalledSites == sites && recalledRegions == regions;
+}
 
-    int _tmp = mkstemps(fileNameBuffer, suffix.size());
-    if (_tmp == -1)
-        throw std::runtime_error("Could not create temp file");
 
-    close(_tmp);    
-    return fileNameBuffer;
-}
+// pureclip recall: write crosslink sites and binding regions from posterior file (-opb) again,
+// e.g. with other merge distance or score cut-off, without parsing alignments and running the HMM
+inline bool recallSites(CharString const &posteriorFileName, AppOptions &options)
+{
+    PosteriorFile file;
+    if (!openPosteriorFile(file, posteriorFileName))
+        return false;
+    options.useCov_RPKM = (file.flags & POSTERIOR_FILE_COVARIATES) != 0;
+
+    // contigs of posterior file
+    ReferenceStore store;
+    unsigned nBlocks = file.blockOffsets.size();
+    for (unsigned k = 0; k < nBlocks; ++k)
+    {
+        CharString contigName;
+        unsigned contigLength;
+        getPosteriorBlockContig(contigName, contigLength, file, k);
+        appendValue(store.contigNameStore, contigName);
+        appendValue(store.contigLengths, contigLength);
+    }
+    if (options.verbosity >= 1) std::cout << "Recall crosslink sites of " << nBlocks << " contigs ..." << std::endl;
 
-inline bool exists_test(const CharString& fileName) {
-    std::ifstream f(toCString(fileName));
-    return f.good();
+    OrderedBedOutput output;
+    if (!open(output, nBlocks, toCString(options.outFileName), toCString(options.outRegionsFileName), options.bgzfOutput, options.numThreadsBgzfOut, "", std::string()))
+        return false;
+    bool stop = false;
+#if HMM_PARALLEL
+    SEQAN_OMP_PRAGMA(parallel for schedule(dynamic, 1) num_threads(options.numThreadsA)) 
+#endif  
+    for (unsigned k = 0; k < nBlocks; ++k)
+    {
+        Data data;
+        std::string sites;
+        std::string regions;
+        std::string posteriors;
+        if (loadPosteriorBlock(data, file, k, k))
+        {
+            formatSites(sites, regions, data, store, k, options);
+        }
+        else
+        {
+            SEQAN_OMP_PRAGMA(critical)
+            {
+                std::cerr << "ERROR: Block of contig " << store.contigNameStore[k] << " in " << posteriorFileName << " is truncated.\n";
+                stop = true;
+            }
+        }
+        push(output, k, sites, regions, posteriors);
+    }
+    if (!close(output))
+    {
+        std::cerr << "ERROR: Could not write output files.\n";
+        return false;
+    }
+    return !stop;
 }
 
 
@@ -959,10 +1396,11 @@ bool doIt(TGamma1 &gamma1, TGamma2 &gamma2, TBIN &bin1, TBIN &bin2, TOptions &op
     double timeStamp = sysTime();
 #endif
 
-    typedef  FragmentStore<>    TStore;
+    typedef  ReferenceStore     TStore;
     TStore store;
     if (options.verbosity >= 1) std::cout << "Loading reference ... " << std::flush;
-    loadContigs(store, toCString(options.refFileName));
+    if (!loadReference(store, options.refFileName, options))
+        return 1;
     loadIntervals(options, store);
     loadApplyChrs(options, store);
 #if SEQAN_HAS_ZLIB
@@ -974,29 +1412,77 @@ bool doIt(TGamma1 &gamma1, TGamma2 &gamma2, TBIN &bin1, TBIN &bin2, TOptions &op
     // ******************  set some parameters
     if (options.binSize == 0.0) options.binSize = options.bandwidth * 2; 
     options.intervalOffset = options.bandwidth * 2;  
-    options.prior_kdeThreshold = options.prior_enrichmentThreshold * getGaussianKernelDensity(0.0/(double)options.bandwidth)/(double)options.bandwidth;
-    if (options.verbosity >= 1) std::cout << " computed prior_kdeThreshold: " << (options.prior_enrichmentThreshold * getGaussianKernelDensity(0.0/(double)options.bandwidth)/(double)options.bandwidth) << std::endl;
+    options.prior_kdeThreshold = options.prior_enrichmentThreshold * getKernelDensity(0.0, options)/(double)options.bandwidth;
+    if (options.verbosity >= 1) std::cout << " computed prior_kdeThreshold: " << (options.prior_enrichmentThreshold * getKernelDensity(0.0, options)/(double)options.bandwidth) << std::endl;
 
     if (options.useKdeThreshold == 0.0 && !options.useCov_RPKM) // TODO use boolean user option
-        options.useKdeThreshold = getGaussianKernelDensity(0.0/(double)options.bandwidth)/(double)options.bandwidth + 0.0001;  // corresponds to KDE value at singleton read start 
+        options.useKdeThreshold = getKernelDensity(0.0, options)/(double)options.bandwidth + 0.0001;  // corresponds to KDE value at singleton read start 
     else if (options.useKdeThreshold == 0.0 && options.useCov_RPKM)
     {
-        options.useKdeThreshold = getGaussianKernelDensity(0.0/(double)options.bandwidth)/(double)options.bandwidth; 
+        options.useKdeThreshold = getKernelDensity(0.0, options)/(double)options.bandwidth; 
         if (options.mrtf_kdeSglt)
             options.minRPKMtoFit = log(options.useKdeThreshold) + 0.0001;
 
     }
     if (options.verbosity >= 1) std::cout << "Use bandwidth: " << options.bandwidth << std::endl;
+    if (options.verbosity >= 2) std::cout << "Use " << kdeKernels().name << " KDE kernels" << std::endl;
     if (options.verbosity >= 1) std::cout << "Use KDE threshold: " << options.useKdeThreshold << std::endl;
     // *****************
     double slr_NfromKDE_b0 = 0.0;
     double slr_NfromKDE_b1 = 0.0;  
 
 
+    // read starts within blacklist regions are removed right after parsing
+    Blacklist blacklist;
+    if (!empty(options.blacklistFileName) && !loadBlacklist(blacklist, options.blacklistFileName, store, options))
+        return 1;
+
+    // if parsed in single pass: indexed by contigId and shared by learning and applying, otherwise indexed by learning interval
     String<ContigObservations> contigObservationsF;
     String<ContigObservations> contigObservationsR;
-    resize(contigObservationsF, length(options.intervals_contigIds), Exact());
-    resize(contigObservationsR, length(options.intervals_contigIds), Exact());
+    if (options.singlePassBam)
+    {
+        CharString cacheFileName;
+        if (options.useCountCache)
+            cacheFileName = getCountCacheFileName(options);
+        if (!options.useCountCache || !loadCountCache(contigObservationsF, contigObservationsR, cacheFileName, store, options))
+        {
+            if (!loadAllObservations(contigObservationsF, contigObservationsR, store, options))
+                return 1;
+            if (options.useCountCache && !writeCountCache(contigObservationsF, contigObservationsR, cacheFileName, store, options))
+                std::cout << "WARNING: Could not write read start count cache " << cacheFileName << std::endl;
+        }
+        if (!empty(options.blacklistFileName))      // after writing cache, which does not depend on blacklist
+        {
+            for (unsigned contigId = 0; contigId < length(contigObservationsF); ++contigId)
+                maskObservations(contigObservationsF[contigId], contigObservationsR[contigId], contigId, blacklist, options);
+        }
+    }
+    else
+    {
+        resize(contigObservationsF, length(options.intervals_contigIds), Exact());
+        resize(contigObservationsR, length(options.intervals_contigIds), Exact());
+    }
+
+    // covariate files are parsed once, used by learning and applying
+    CovariateSource covSource;
+    if (!empty(options.rpkmFileName))
+    {
+        if (options.verbosity >= 1) std::cout << "Parse covariates ... input signal" << std::endl;
+        if (!loadCovariateSource(covSource, options.rpkmFileName, store, options))
+            return 1;
+        if (covSource.isTrack && !checkControlKdeTrack(covSource.track, options.rpkmFileName, options))
+            return 1;
+    }
+    CovariateSource motifSource;
+    if (!empty(options.fimoFileName))
+    {
+        if (options.verbosity >= 1) std::cout << "Parse covariates ... fimo scores for input motifs" << std::endl;
+        if (!loadCovariateSource(motifSource, options.fimoFileName, store, options))
+            return 1;
+        if (motifSource.isTrack && motifSource.track.maxMotifId < options.nInputMotifs)
+            std::cout << "WARNING: Motif covariate track " << options.fimoFileName << " only contains motif IDs up to " << motifSource.track.maxMotifId << "." << std::endl;
+    }
 
     Data data;
     resize(data.setObs, 2);
@@ -1010,27 +1496,32 @@ bool doIt(TGamma1 &gamma1, TGamma2 &gamma2, TBIN &bin1, TBIN &bin2, TOptions &op
     for (unsigned i = 0; i < length(options.intervals_contigIds); ++i)
     {
         unsigned contigId = options.intervals_contigIds[i];
+        unsigned i1 = options.intervals_positions[i][0];    // interval begin
+        unsigned i2 = options.intervals_positions[i][1];    // interval end
+        unsigned obsId = i;
 
-        if (!loadObservations(contigObservationsF[i], contigObservationsR[i], contigId, store, options))
+        if (options.singlePassBam)
+            obsId = contigId;
+        else if (!loadObservations(contigObservationsF[i], contigObservationsR[i], contigId, i1, i2, store, options))
             stop = true; 
+        else
+            maskObservations(contigObservationsF[i], contigObservationsR[i], contigId, blacklist, options);
 
         String<double> contigCovsF;
         String<double> contigCovsR;
-        loadCovariates(contigCovsF, contigCovsR, contigId, store, options); 
+        loadCovariates(contigCovsF, contigCovsR, contigId, covSource, store, options); 
         String<String<float> > contigCovsFimo;
         String<String<char> > motifIds;
-        loadMotifCovariates(contigCovsFimo, motifIds, contigId, store, options); 
+        loadMotifCovariates(contigCovsFimo, motifIds, contigId, motifSource, store, options); 
 
         // Extract covered intervals for learning
-        unsigned i1 = options.intervals_positions[i][0];    // interval begin
-        unsigned i2 = options.intervals_positions[i][1];    // interval end
         Data c_data;                
         resize(c_data.setObs, 2);
         resize(c_data.setPos, 2);
         resize(c_data.statePosteriors, 2);
         resize(c_data.states, 2);
 
-        extractCoveredIntervals(c_data, contigObservationsF[i], contigObservationsR[i], contigCovsF, contigCovsR, contigCovsFimo, motifIds, contigId, i1, i2, options.excludePolyAFromLearning, options.excludePolyTFromLearning, store, options); 
+        extractCoveredIntervals(c_data, contigObservationsF[obsId], contigObservationsR[obsId], contigCovsF, contigCovsR, contigCovsFimo, motifIds, contigId, i1, i2, options.excludePolyAFromLearning, options.excludePolyTFromLearning, store, options); 
 
         SEQAN_OMP_PRAGMA(critical)
         append(data, c_data);           
@@ -1059,17 +1550,21 @@ bool doIt(TGamma1 &gamma1, TGamma2 &gamma2, TBIN &bin1, TBIN &bin2, TOptions &op
     if (!learnHMM(data, transMatrix, gamma1, gamma2, bin1, bin2, options))
         return 1;
 
-    clear(contigObservationsF);
-    clear(contigObservationsR);
+    if (!options.singlePassBam)
+    {
+        clear(contigObservationsF);
+        clear(contigObservationsR);
+    }
 
     if (options.verbosity >= 1) std::cout << "Apply learned parameters to whole genome  ..." << std::endl;
 #if HMM_PARALLEL
     omp_set_num_threads(options.numThreadsA);
 #endif  
-    String<CharString> contigTempFileNamesBed;
-    String<CharString> contigTempFileNamesBed2;  
-    resize(contigTempFileNamesBed, length(store.contigStore));
-    resize(contigTempFileNamesBed2, length(store.contigStore));
+    // results of contigs are written in contig order as soon as preceding contigs are done
+    OrderedBedOutput output;
+    if (!open(output, length(options.applyChr_contigIds), toCString(options.outFileName), toCString(options.outRegionsFileName), options.bgzfOutput, options.numThreadsBgzfOut,
+              toCString(options.outPosteriorsFileName), getPosteriorFileHeader(options)))
+        return 1;
 
 #ifdef HMM_PROFILE
     double timeStamp2 = sysTime();
@@ -1083,29 +1578,39 @@ bool doIt(TGamma1 &gamma1, TGamma2 &gamma2, TBIN &bin1, TBIN &bin2, TOptions &op
         unsigned contigId = options.applyChr_contigIds[i];
         if (options.verbosity >= 1) std::cout << "  " << store.contigNameStore[contigId] << std::endl;
 
-        ContigObservations contigObservationsF;
-        ContigObservations contigObservationsR;
+        ContigObservations c_contigObservationsF;
+        ContigObservations c_contigObservationsR;
 
-        if (!loadObservations(contigObservationsF, contigObservationsR, contigId, store, options))
-            stop = true; 
+        if (!options.singlePassBam)
+        {
+            if (!loadObservations(c_contigObservationsF, c_contigObservationsR, contigId, 0, getContigLength(store, contigId), store, options))
+                stop = true; 
+            else
+                maskObservations(c_contigObservationsF, c_contigObservationsR, contigId, blacklist, options);
+        }
+        ContigObservations &obsF = (options.singlePassBam) ? contigObservationsF[contigId] : c_contigObservationsF;
+        ContigObservations &obsR = (options.singlePassBam) ? contigObservationsR[contigId] : c_contigObservationsR;
 
         String<double> c_contigCovsF;
         String<double> c_contigCovsR;
-        loadCovariates(c_contigCovsF, c_contigCovsR, contigId, store, options); 
+        loadCovariates(c_contigCovsF, c_contigCovsR, contigId, covSource, store, options); 
         String<String<float> > c_contigCovsFimo;
         String<String<char> > c_motifIds;
-        loadMotifCovariates(c_contigCovsFimo, c_motifIds, contigId, store, options); 
+        loadMotifCovariates(c_contigCovsFimo, c_motifIds, contigId, motifSource, store, options); 
 
         // Extract covered intervals
         unsigned i1 = 0;    
-        unsigned i2 = length(store.contigStore[contigId].seq);    
+        unsigned i2 = getContigLength(store, contigId);    
         Data c_data;                
         resize(c_data.setObs, 2);
         resize(c_data.setPos, 2);
         resize(c_data.statePosteriors, 2);
         resize(c_data.states, 2); 
-        extractCoveredIntervals(c_data, contigObservationsF, contigObservationsR, c_contigCovsF, c_contigCovsR, c_contigCovsFimo, c_motifIds, contigId, i1, i2, options.excludePolyA, options.excludePolyT, store, options); 
+        extractCoveredIntervals(c_data, obsF, obsR, c_contigCovsF, c_contigCovsR, c_contigCovsFimo, c_motifIds, contigId, i1, i2, options.excludePolyA, options.excludePolyT, store, options); 
 
+        std::string c_sites;
+        std::string c_regions;
+        std::string c_posteriors;
         if (!empty(c_data.setObs[0]) || !empty(c_data.setObs[1]))   // TODO handle cases
         {
 
@@ -1118,115 +1623,21 @@ bool doIt(TGamma1 &gamma1, TGamma2 &gamma2, TBIN &bin1, TBIN &bin2, TOptions &op
                 stop = true;
             }
 
-            // Temp. output
-            CharString tempFileNameBed;
-
-            if (empty(options.tempPath))
+            formatSites(c_sites, c_regions, c_data, store, contigId, options);
+            if (!empty(options.outPosteriorsFileName))
             {
-                SEQAN_OMP_PRAGMA(critical)
-                append(tempFileNameBed, SEQAN_TEMP_FILENAME());
-                std::stringstream ss;
-                ss << contigId;
-                append(tempFileNameBed, ss.str());
-                append(tempFileNameBed, ".bed");
+                appendPosteriorBlock(c_posteriors, c_data, store, contigId, options);
+                SEQAN_ASSERT(verifyPosteriorBlock(c_posteriors, c_sites, c_regions, store, contigId, options));
             }
-            else
-            {
-                SEQAN_OMP_PRAGMA(critical)
-                tempFileNameBed = myTempFileName(".bed", toCString(options.tempPath));
-            }
-
-            contigTempFileNamesBed[contigId] = tempFileNameBed;
-            if (options.verbosity >= 2) std::cout << "temp file Name: " << tempFileNameBed << std::endl;
-            BedFileOut outBed(toCString(tempFileNameBed)); 
-            writeStates(outBed, c_data, store, contigId, options);  
-            
-            if (!empty(options.outRegionsFileName))
-            {
-                if (empty(options.tempPath))
-                {
-
-                    SEQAN_OMP_PRAGMA(critical)
-                    tempFileNameBed = SEQAN_TEMP_FILENAME();
-                    std::stringstream ss;
-                    ss << contigId;
-                    append(tempFileNameBed, ss.str());
-                    append(tempFileNameBed, ".regions.bed");
-                }
-                else
-                {
-                    SEQAN_OMP_PRAGMA(critical)
-                    tempFileNameBed = myTempFileName(".regions.bed", toCString(options.tempPath));
-                }
-
-                contigTempFileNamesBed2[contigId] = tempFileNameBed;
-                if (options.verbosity >= 2) std::cout << "temp file Name: " << tempFileNameBed << std::endl;
-                BedFileOut outBed2(toCString(tempFileNameBed)); 
-
-                writeRegions(outBed2, c_data, store, contigId, options);              
-            }
-        }
-    }
-    if (stop) return 1;
-
-    // Append content of temp files to final output in contig order
-    // crosslink sites
-    BedFileOut outBed(toCString(options.outFileName)); 
-    for (unsigned i = 0; i < length(options.applyChr_contigIds); ++i)
-    {
-        unsigned contigId = options.applyChr_contigIds[i];
-        // BED
-        BedFileIn bedFileIn;
-        if (!open(bedFileIn, toCString(contigTempFileNamesBed[contigId])))
-        {
-            //std::cerr << "ERROR: Could not open temporary bed file: " << contigTempFileNamesBed[contigId] << "\n";
-            continue;
-        }
-
-        BedRecord<seqan::Bed6> bedRecord;
-        while (!atEnd(bedFileIn))
-        {
-            readRecord(bedRecord, bedFileIn);
-            writeRecord(outBed, bedRecord);
-        }
-        std::remove(toCString(contigTempFileNamesBed[contigId]));
-        if (exists_test(contigTempFileNamesBed[contigId]))
-        {
-            std::cerr << "ERROR: Could open temporary bed file which should be deleted: " << contigTempFileNamesBed[contigId]  << std::endl;
-            return 1;
         }
+        push(output, i, c_sites, c_regions, c_posteriors);
     }
-
-    // Append content of temp files to final output in contig order
-    // binding regions
-    if (!empty(options.outRegionsFileName))
+    if (!close(output))
     {
-        BedFileOut outBed2(toCString(options.outRegionsFileName)); 
-        for (unsigned i = 0; i < length(options.applyChr_contigIds); ++i)
-        {
-            unsigned contigId = options.applyChr_contigIds[i];
-            // BED
-            BedFileIn bedFileIn;
-            if (!open(bedFileIn, toCString(contigTempFileNamesBed2[contigId])))
-            {
-                //std::cerr << "ERROR: Could not open temporary bed file: " << contigTempFileNamesBed[contigId] << "\n";
-                continue;
-            }
-
-            BedRecord<seqan::Bed6> bedRecord;
-            while (!atEnd(bedFileIn))
-            {
-                readRecord(bedRecord, bedFileIn);
-                writeRecord(outBed2, bedRecord);
-            }
-            std::remove(toCString(contigTempFileNamesBed2[contigId]));
-            if (exists_test(contigTempFileNamesBed2[contigId]))
-            {
-                std::cerr << "ERROR: Could open temporary bed file which should be deleted: " << contigTempFileNamesBed2[contigId]  << std::endl;
-                return 1;
-            }
-        }
+        std::cerr << "ERROR: Could not write output files.\n";
+        return 1;
     }
+    if (stop) return 1;
 
 #ifdef HMM_PROFILE
     Times::instance().time_applyHMM2 = sysTime() - timeStamp2;
@@ -0,0 +1,317 @@
+// ======================================================================
+// PureCLIP: capturing target-specific protein-RNA interaction footprints
+// ======================================================================
+// Copyright (C) 2017  Sabrina Krakau, Max Planck Institute for Molecular
+// Genetics
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// =======================================================================
+// Author: Sabrina Krakau <krakau@molgen.mpg.de>
+// =======================================================================
+
+#ifndef APPS_HMMS_COUNT_CACHE_H_
+#define APPS_HMMS_COUNT_CACHE_H_
+
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+using namespace seqan;
+
+// Binary cache of read start counts (truncCounts) of a BAM file
+//
+// header:  char[8] magic, uint64 hash of absolute BAM path, uint64 BAM device, uint64 BAM inode,
+//          uint64 BAM file size, int64 BAM mtime, uint32 no. of contigs
+// index:   for each contig: uint32 name length, name, uint32 contig length,
+//          for F and R: uint64 file offset, uint32 no. of entries
+// data:    for each contig and strand: uint32 positions[n], uint8 counts[n]
+//          positions are forward strand coordinates, sorted
+
+static char const COUNT_CACHE_MAGIC[8] = {'P', 'C', 'L', 'I', 'P', 'T', 'C', '2'};
+static size_t const COUNT_CACHE_HEADER_SIZE = 8 + 5 * 8 + 4;
+
+
+// identifies BAM file: different files with same name (or copies with same size and mtime) get different keys
+struct BamFileKey
+{
+    __uint64    pathHash;       // FNV-1a of absolute path
+    __uint64    device;
+    __uint64    inode;
+    __uint64    fileSize;
+    __int64     mTime;
+};
+
+inline __uint64 getBamPathHash(CharString const &bamFileName)
+{
+    char * absPath = realpath(toCString(bamFileName), NULL);
+    std::string path = (absPath != NULL) ? absPath : toCString(bamFileName);
+    free(absPath);
+
+    __uint64 hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < path.size(); ++i)
+    {
+        hash ^= (unsigned char)path[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+inline bool getBamFileKey(BamFileKey &key, CharString const &bamFileName)
+{
+    struct stat st;
+    if (stat(toCString(bamFileName), &st) != 0)
+        return false;
+    key.pathHash = getBamPathHash(bamFileName);
+    key.device = st.st_dev;
+    key.inode = st.st_ino;
+    key.fileSize = st.st_size;
+    key.mTime = st.st_mtime;
+    return true;
+}
+
+
+// <basename>.<path hash>.pureclip.counts, BAM files with same basename do not share cache file
+inline CharString getCountCacheFileName(AppOptions const &options)
+{
+    std::string bamFileName = toCString(options.bamFileName);
+    std::string baseName = bamFileName.substr(bamFileName.find_last_of('/') + 1);
+    char hashStr[17];
+    snprintf(hashStr, sizeof(hashStr), "%016llx", (unsigned long long)getBamPathHash(options.bamFileName));
+
+    std::string dir;
+    if (!empty(options.tempPath))
+    {
+        dir = toCString(options.tempPath);
+        if (dir[dir.size() - 1] != '/')
+            dir += '/';
+    }
+    else
+    {
+        std::string outFileName = toCString(options.outFileName);
+        size_t pos = outFileName.find_last_of('/');
+        if (pos != std::string::npos)
+            dir = outFileName.substr(0, pos + 1);
+    }
+    return CharString(dir + baseName + "." + hashStr + ".pureclip.counts");
+}
+
+
+template <typename TValue>
+inline void writeRaw(std::ofstream &out, TValue const &value)
+{
+    out.write(reinterpret_cast<char const *>(&value), sizeof(TValue));
+}
+
+
+// write read start counts of all loaded contigs, R counts are expected to be reversed already
+template <typename TContigObservations, typename TStore>
+bool writeCountCache(String<TContigObservations> &contigObservationsF, String<TContigObservations> &contigObservationsR, CharString const &cacheFileName, TStore &store, AppOptions &options)
+{
+    BamFileKey key;
+    if (!getBamFileKey(key, options.bamFileName))
+        return false;
+
+    String<unsigned> contigIds;
+    __uint64 indexSize = 0;
+    for (unsigned contigId = 0; contigId < length(contigObservationsF); ++contigId)
+    {
+        if (empty(contigObservationsF[contigId]))
+            continue;
+        appendValue(contigIds, contigId);
+        indexSize += 4 + length(store.contigNameStore[contigId]) + 4 + 2 * (8 + 4);
+    }
+
+    CharString tempFileName = cacheFileName;
+    append(tempFileName, ".part");
+    std::ofstream out(toCString(tempFileName), std::ios::binary | std::ios::out);
+    if (!out.good())
+        return false;
+
+    out.write(COUNT_CACHE_MAGIC, 8);
+    writeRaw(out, key.pathHash);
+    writeRaw(out, key.device);
+    writeRaw(out, key.inode);
+    writeRaw(out, key.fileSize);
+    writeRaw(out, key.mTime);
+    writeRaw(out, (__uint32)length(contigIds));
+
+    __uint64 offset = COUNT_CACHE_HEADER_SIZE + indexSize;
+    for (unsigned i = 0; i < length(contigIds); ++i)
+    {
+        unsigned contigId = contigIds[i];
+        writeRaw(out, (__uint32)length(store.contigNameStore[contigId]));
+        out.write(toCString(store.contigNameStore[contigId]), length(store.contigNameStore[contigId]));
+        writeRaw(out, (__uint32)contigObservationsF[contigId].contigLength);
+        writeRaw(out, offset);
+        writeRaw(out, (__uint32)length(contigObservationsF[contigId].positions));
+        offset += 5 * (__uint64)length(contigObservationsF[contigId].positions);
+        writeRaw(out, offset);
+        writeRaw(out, (__uint32)length(contigObservationsR[contigId].positions));
+        offset += 5 * (__uint64)length(contigObservationsR[contigId].positions);
+    }
+
+    for (unsigned i = 0; i < length(contigIds); ++i)
+    {
+        TContigObservations &obsF = contigObservationsF[contigIds[i]];
+        TContigObservations &obsR = contigObservationsR[contigIds[i]];
+
+        out.write(reinterpret_cast<char const *>(begin(obsF.positions, Standard())), 4 * length(obsF.positions));
+        out.write(reinterpret_cast<char const *>(begin(obsF.counts, Standard())), length(obsF.counts));
+        // R: reversed, store forward coordinates in ascending order
+        for (unsigned k = length(obsR.positions); k > 0; --k)
+            writeRaw(out, (__uint32)(obsR.contigLength - obsR.positions[k - 1] - 1));
+        for (unsigned k = length(obsR.counts); k > 0; --k)
+            writeRaw(out, obsR.counts[k - 1]);
+    }
+    out.close();
+    if (!out.good() || std::rename(toCString(tempFileName), toCString(cacheFileName)) != 0)
+    {
+        std::remove(toCString(tempFileName));
+        return false;
+    }
+    if (options.verbosity >= 1) std::cout << "Wrote read start count cache " << cacheFileName << std::endl;
+    return true;
+}
+
+
+// load read start counts of all contigs used for learning or applying from memory-mapped cache file
+// returns false if cache does not exist, does not match BAM file or misses a contig
+template <typename TContigObservations, typename TStore>
+bool loadCountCache(String<TContigObservations> &contigObservationsF, String<TContigObservations> &contigObservationsR, CharString const &cacheFileName, TStore &store, AppOptions &options)
+{
+    BamFileKey key;
+    if (!getBamFileKey(key, options.bamFileName))
+        return false;
+
+    int fd = ::open(toCString(cacheFileName), O_RDONLY);
+    if (fd == -1)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)COUNT_CACHE_HEADER_SIZE)
+    {
+        ::close(fd);
+        return false;
+    }
+    size_t fileSize = st.st_size;
+    void * mapped = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED)
+        return false;
+    char const * raw = static_cast<char const *>(mapped);
+
+    BamFileKey cachedKey;
+    __uint32 nContigs;
+    std::memcpy(&cachedKey.pathHash, raw + 8, 8);
+    std::memcpy(&cachedKey.device, raw + 16, 8);
+    std::memcpy(&cachedKey.inode, raw + 24, 8);
+    std::memcpy(&cachedKey.fileSize, raw + 32, 8);
+    std::memcpy(&cachedKey.mTime, raw + 40, 8);
+    std::memcpy(&nContigs, raw + 48, 4);
+    if (std::memcmp(raw, COUNT_CACHE_MAGIC, 8) != 0 || cachedKey.pathHash != key.pathHash || cachedKey.device != key.device ||
+        cachedKey.inode != key.inode || cachedKey.fileSize != key.fileSize || cachedKey.mTime != key.mTime)
+    {
+        if (options.verbosity >= 1) std::cout << "Read start count cache " << cacheFileName << " does not match BAM file, ignored." << std::endl;
+        munmap(mapped, fileSize);
+        return false;
+    }
+
+    // contig name -> position of index entry
+    std::map<std::string, size_t> contigEntries;
+    size_t p = COUNT_CACHE_HEADER_SIZE;
+    for (unsigned i = 0; i < nContigs && p + 4 <= fileSize; ++i)
+    {
+        __uint32 nameLength;
+        std::memcpy(&nameLength, raw + p, 4);
+        if (p + 4 + nameLength + 28 > fileSize)
+            break;
+        contigEntries[std::string(raw + p + 4, nameLength)] = p + 4 + nameLength;
+        p += 4 + nameLength + 28;
+    }
+
+    resize(contigObservationsF, length(store.contigNameStore), Exact());
+    resize(contigObservationsR, length(store.contigNameStore), Exact());
+    String<unsigned> contigIds = options.intervals_contigIds;
+    append(contigIds, options.applyChr_contigIds);
+    bool complete = true;
+    for (unsigned i = 0; i < length(contigIds) && complete; ++i)
+    {
+        unsigned contigId = contigIds[i];
+        if (!empty(contigObservationsF[contigId]))
+            continue;
+
+        std::map<std::string, size_t>::const_iterator it = contigEntries.find(toCString(store.contigNameStore[contigId]));
+        __uint32 contigLength = 0;
+        if (it != contigEntries.end())
+            std::memcpy(&contigLength, raw + it->second, 4);
+        if (it == contigEntries.end() || contigLength != getContigLength(store, contigId))
+        {
+            complete = false;
+            break;
+        }
+
+        init(contigObservationsF[contigId], contigLength);
+        init(contigObservationsR[contigId], contigLength);
+        for (unsigned s = 0; s < 2; ++s)
+        {
+            __uint64 offset;
+            __uint32 n;
+            std::memcpy(&offset, raw + it->second + 4 + s * 12, 8);
+            std::memcpy(&n, raw + it->second + 4 + s * 12 + 8, 4);
+            if (offset + 5 * (__uint64)n > fileSize)
+            {
+                complete = false;
+                break;
+            }
+            TContigObservations &obs = (s == 0) ? contigObservationsF[contigId] : contigObservationsR[contigId];
+            resize(obs.positions, n, Exact());
+            resize(obs.counts, n, Exact());
+            std::memcpy(begin(obs.counts, Standard()), raw + offset + 4 * (__uint64)n, n);
+            for (unsigned j = 0; j < n; ++j)
+            {
+                __uint32 pos;
+                std::memcpy(&pos, raw + offset + 4 * (__uint64)j, 4);
+                if (pos >= contigLength)
+                {
+                    complete = false;
+                    break;
+                }
+                obs.positions[j] = pos;
+            }
+            if (s == 1)     // reversed
+                reverse(obs);
+        }
+    }
+    munmap(mapped, fileSize);
+
+    if (!complete)
+    {
+        if (options.verbosity >= 1) std::cout << "Read start count cache " << cacheFileName << " does not contain all contigs, ignored." << std::endl;
+        clear(contigObservationsF);
+        clear(contigObservationsR);
+        return false;
+    }
+    if (options.verbosity >= 1) std::cout << "Loaded read start counts from cache " << cacheFileName << std::endl;
+    return true;
+}
+
+#endif
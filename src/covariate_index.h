@@ -0,0 +1,178 @@
+// ======================================================================
+// PureCLIP: capturing target-specific protein-RNA interaction footprints
+// ======================================================================
+// Copyright (C) 2017  Sabrina Krakau, Max Planck Institute for Molecular
+// Genetics
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// =======================================================================
+// Author: Sabrina Krakau <krakau@molgen.mpg.de>
+// =======================================================================
+
+#ifndef APPS_HMMS_COVARIATE_INDEX_H_
+#define APPS_HMMS_COVARIATE_INDEX_H_
+
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+using namespace seqan;
+
+
+// BED6 covariate record, reduced to the fields used
+struct CovariateRecord
+{
+    __int32     beginPos;
+    __int32     endPos;
+    __int32     id;         // numeric name column, 0 if not numeric
+    double      score;
+    char        strand;
+};
+
+// records of covariate BED file, parsed once and bucketed by contigId
+struct CovariateIndex
+{
+    String<String<CovariateRecord> > contigRecords;
+};
+
+
+// parse unsigned or negative integer, returns position after last digit
+inline char const * parseInt(__int32 &value, char const * it, char const * end)
+{
+    bool negative = (it < end && *it == '-');
+    if (negative) ++it;
+    __int64 v = 0;
+    while (it < end && *it >= '0' && *it <= '9')
+        v = v * 10 + (*it++ - '0');
+    value = (negative) ? -v : v;
+    return it;
+}
+
+// split tab separated line into at most maxFields fields
+inline unsigned splitFields(char const ** fieldBegins, char const ** fieldEnds, unsigned maxFields, char const * it, char const * lineEnd)
+{
+    unsigned n = 0;
+    while (n < maxFields)
+    {
+        fieldBegins[n] = it;
+        while (it < lineEnd && *it != '\t') ++it;
+        fieldEnds[n++] = it;
+        if (it >= lineEnd) break;
+        ++it;
+    }
+    return n;
+}
+
+// parse BED6 file once, records of contigs not in store are skipped
+template <typename TStore>
+bool loadCovariateIndex(CovariateIndex &index, CharString const &fileName, TStore &store, AppOptions &options)
+{
+    typedef StringSet<CharString>   TNameStore;
+
+    clear(index.contigRecords);
+    resize(index.contigRecords, length(store.contigNameStore), Exact());
+
+    int fd = ::open(toCString(fileName), O_RDONLY);
+    if (fd == -1)
+    {
+        std::cerr << "ERROR: Could not open " << fileName << " for reading.\n";
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        ::close(fd);
+        std::cerr << "ERROR: Could not open " << fileName << " for reading.\n";
+        return false;
+    }
+    size_t fileSize = st.st_size;
+    if (fileSize == 0)
+    {
+        ::close(fd);
+        return true;
+    }
+    void * mapped = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED)
+    {
+        std::cerr << "ERROR: Could not read " << fileName << ".\n";
+        return false;
+    }
+    madvise(mapped, fileSize, MADV_SEQUENTIAL);
+
+    NameStoreCache<TNameStore> nameStoreCache(store.contigNameStore);
+    CharString contigName;
+    int contigId = -1;
+    unsigned long lineNo = 0;
+    unsigned long nRecords = 0;
+    char const * it = static_cast<char const *>(mapped);
+    char const * fileEnd = it + fileSize;
+    while (it < fileEnd)
+    {
+        char const * lineEnd = static_cast<char const *>(std::memchr(it, '\n', fileEnd - it));
+        if (lineEnd == NULL) lineEnd = fileEnd;
+        char const * lineBegin = it;
+        it = lineEnd + 1;
+        ++lineNo;
+        if (lineEnd > lineBegin && *(lineEnd - 1) == '\r') --lineEnd;
+        if (lineBegin == lineEnd || *lineBegin == '#' ||
+            (lineEnd - lineBegin >= 5 && std::strncmp(lineBegin, "track", 5) == 0) ||
+            (lineEnd - lineBegin >= 7 && std::strncmp(lineBegin, "browser", 7) == 0))
+            continue;
+
+        char const * fieldBegins[6];
+        char const * fieldEnds[6];
+        if (splitFields(fieldBegins, fieldEnds, 6, lineBegin, lineEnd) < 6)
+        {
+            std::cerr << "ERROR: input BED record in line " << lineNo << " is badly formatted. Ignored.\n";
+            continue;
+        }
+
+        // records are usually sorted by contig: only look up name if it changed
+        if (length(contigName) != (size_t)(fieldEnds[0] - fieldBegins[0]) ||
+            std::strncmp(toCString(contigName), fieldBegins[0], fieldEnds[0] - fieldBegins[0]) != 0)
+        {
+            contigName = CharString(std::string(fieldBegins[0], fieldEnds[0]));
+            unsigned id;
+            contigId = (getIdByName(id, nameStoreCache, contigName)) ? (int)id : -1;
+        }
+        if (contigId < 0)
+            continue;
+
+        CovariateRecord record;
+        if (parseInt(record.beginPos, fieldBegins[1], fieldEnds[1]) != fieldEnds[1] ||
+            parseInt(record.endPos, fieldBegins[2], fieldEnds[2]) != fieldEnds[2] ||
+            fieldBegins[1] == fieldEnds[1] || fieldBegins[2] == fieldEnds[2])
+        {
+            std::cerr << "ERROR: input BED record in line " << lineNo << " is badly formatted. Ignored.\n";
+            continue;
+        }
+        parseInt(record.id, fieldBegins[3], fieldEnds[3]);
+        record.score = std::strtod(fieldBegins[4], NULL);
+        record.strand = (fieldBegins[5] < fieldEnds[5]) ? *fieldBegins[5] : '.';
+        appendValue(index.contigRecords[contigId], record, Generous());
+        ++nRecords;
+    }
+    munmap(mapped, fileSize);
+
+    if (options.verbosity >= 2) std::cout << "Indexed " << nRecords << " covariate records of " << fileName << std::endl;
+    return true;
+}
+
+#endif
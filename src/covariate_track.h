@@ -0,0 +1,430 @@
+// ======================================================================
+// PureCLIP: capturing target-specific protein-RNA interaction footprints
+// ======================================================================
+// Copyright (C) 2017  Sabrina Krakau, Max Planck Institute for Molecular
+// Genetics
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// =======================================================================
+// Author: Sabrina Krakau <krakau@molgen.mpg.de>
+// =======================================================================
+
+#ifndef APPS_HMMS_COVARIATE_TRACK_H_
+#define APPS_HMMS_COVARIATE_TRACK_H_
+
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+using namespace seqan;
+
+// Binary covariate track (.pcov)
+//
+// header:  char[8] magic, uint32 version, uint32 flags, uint32 max. motif id, uint32 no. of contigs,
+//          uint32 KDE bandwidth (version >= 2, 0 if values are no KDEs),
+//          uint32 KDE kernel (0 gaussian, 1 epanechnikov, 2 triangular, 3 box), uint32 KDE engine (version >= 3)
+// index:   for each contig: uint32 name length, name, uint32 contig length,
+//          for F and R: uint64 file offset, uint32 no. of runs, uint32 no. of values
+// data:    for each contig and strand: runs as uint32 [begin, end) pairs, float32 values of all runs,
+//          if flag COV_TRACK_MOTIF_IDS: uint8 motif ids (1-based) of all runs
+// Positions outside of runs have no covariate value. Forward strand coordinates.
+
+static char const COV_TRACK_MAGIC[8] = {'P', 'C', 'L', 'I', 'P', 'C', 'O', 'V'};
+static __uint32 const COV_TRACK_VERSION = 3;
+static __uint32 const COV_TRACK_MOTIF_IDS = 1;
+
+struct CovariateTrackBlock
+{
+    __uint64    offset;
+    __uint32    nRuns;
+    __uint32    nValues;
+};
+
+// memory-mapped covariate track, blocks are indexed by contigId of reference store
+struct CovariateTrack
+{
+    char const *        data;
+    size_t              fileSize;
+    __uint32            flags;
+    __uint32            maxMotifId;
+    __uint32            bandwidth;
+    __uint32            kernel;
+    __uint32            kdeEngine;
+    String<__int64>     contigLengths;      // -1 if contig is not contained
+    String<CovariateTrackBlock> blocks;     // 2 per contig
+
+    CovariateTrack() : data(NULL), fileSize(0), flags(0), maxMotifId(0), bandwidth(0), kernel(0), kdeEngine(KDE_SPARSE) {}
+    ~CovariateTrack()
+    {
+        if (data != NULL)
+            munmap(const_cast<char *>(data), fileSize);
+    }
+
+private:
+    CovariateTrack(CovariateTrack const &);
+    CovariateTrack & operator=(CovariateTrack const &);
+};
+
+// covariates of a BED file: either parsed records or memory-mapped binary track
+struct CovariateSource
+{
+    bool                isTrack;
+    CovariateIndex      index;
+    CovariateTrack      track;
+
+    CovariateSource() : isTrack(false) {}
+};
+
+inline bool isCovariateTrackFile(CharString const &fileName)
+{
+    return length(fileName) >= 5 && suffix(fileName, length(fileName) - 5) == ".pcov";
+}
+
+// kernel id stored in track header
+inline __uint32 getKdeKernelId(AppOptions const &options)
+{
+    if (options.epanechnikovKernel)
+        return 1;
+    else if (options.triangularKernel)
+        return 2;
+    else if (options.boxKernel)
+        return 3;
+    return 0;
+}
+
+inline char const * getKdeKernelName(__uint32 kernel)
+{
+    static char const * names[4] = {"gaussian", "epanechnikov", "triangular", "box"};
+    return (kernel < 4) ? names[kernel] : "unknown";
+}
+
+// control KDEs (pureclip ctrlkde) have to be computed with the same bandwidth and kernel as the KDEs of this run
+inline bool checkControlKdeTrack(CovariateTrack const &track, CharString const &fileName, AppOptions const &options)
+{
+    if (track.bandwidth == 0)       // no KDEs
+        return true;
+    if (track.bandwidth != options.bandwidth || track.kernel != getKdeKernelId(options))
+    {
+        std::cerr << "ERROR: Control KDEs in " << fileName << " were computed with bandwidth " << track.bandwidth << " and kernel " << getKdeKernelName(track.kernel);
+        std::cerr << ", but bandwidth " << options.bandwidth << " and kernel " << getKdeKernelName(getKdeKernelId(options)) << " are used. Recompute them with 'pureclip ctrlkde'.\n";
+        return false;
+    }
+    if (track.kdeEngine != (__uint32)options.kdeEngine && options.verbosity >= 1)
+        std::cout << "Control KDEs in " << fileName << " were computed with another KDE engine (-ke), values may differ by rounding." << std::endl;
+    return true;
+}
+
+
+template <typename TStore>
+bool openCovariateTrack(CovariateTrack &track, CharString const &fileName, TStore &store)
+{
+    typedef StringSet<CharString>   TNameStore;
+
+    int fd = ::open(toCString(fileName), O_RDONLY);
+    if (fd == -1)
+    {
+        std::cerr << "ERROR: Could not open " << fileName << " for reading.\n";
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 24)
+    {
+        ::close(fd);
+        std::cerr << "ERROR: " << fileName << " is not a valid covariate track.\n";
+        return false;
+    }
+    track.fileSize = st.st_size;
+    void * mapped = mmap(NULL, track.fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED)
+    {
+        std::cerr << "ERROR: Could not read " << fileName << ".\n";
+        return false;
+    }
+    track.data = static_cast<char const *>(mapped);
+
+    __uint32 version;
+    __uint32 nContigs;
+    std::memcpy(&version, track.data + 8, 4);
+    std::memcpy(&track.flags, track.data + 12, 4);
+    std::memcpy(&track.maxMotifId, track.data + 16, 4);
+    std::memcpy(&nContigs, track.data + 20, 4);
+    if (std::memcmp(track.data, COV_TRACK_MAGIC, 8) != 0 || version < 1 || version > COV_TRACK_VERSION || (version >= 2 && track.fileSize < 28) || (version >= 3 && track.fileSize < 36))
+    {
+        std::cerr << "ERROR: " << fileName << " is not a valid covariate track.\n";
+        return false;
+    }
+    size_t p = 24;
+    if (version >= 2)
+    {
+        std::memcpy(&track.bandwidth, track.data + 24, 4);
+        p = 28;
+    }
+    if (version >= 3)
+    {
+        std::memcpy(&track.kernel, track.data + 28, 4);
+        std::memcpy(&track.kdeEngine, track.data + 32, 4);
+        p = 36;
+    }
+    else if (track.bandwidth != 0)
+    {
+        std::cerr << "ERROR: Kernel of control KDEs in " << fileName << " is unknown (older version), recompute them with 'pureclip ctrlkde'.\n";
+        return false;
+    }
+
+    resize(track.contigLengths, length(store.contigNameStore), -1, Exact());
+    resize(track.blocks, 2 * length(store.contigNameStore), Exact());
+    NameStoreCache<TNameStore> nameStoreCache(store.contigNameStore);
+    for (unsigned i = 0; i < nContigs; ++i)
+    {
+        __uint32 nameLength = 0;
+        if (p + 4 <= track.fileSize)
+            std::memcpy(&nameLength, track.data + p, 4);
+        if (p + 4 > track.fileSize || p + 4 + nameLength + 36 > track.fileSize)
+        {
+            std::cerr << "ERROR: Index of covariate track " << fileName << " is truncated.\n";
+            return false;
+        }
+        CharString contigName = CharString(std::string(track.data + p + 4, nameLength));
+        p += 4 + nameLength;
+        __uint32 contigLength;
+        std::memcpy(&contigLength, track.data + p, 4);
+
+        unsigned contigId;
+        if (getIdByName(contigId, nameStoreCache, contigName))
+        {
+            if (contigLength != getContigLength(store, contigId))
+            {
+                std::cerr << "ERROR: Contig " << contigName << " has length " << contigLength << " in covariate track " << fileName << ", but " << getContigLength(store, contigId) << " in reference (other assembly?).\n";
+                return false;
+            }
+            track.contigLengths[contigId] = contigLength;
+            for (unsigned s = 0; s < 2; ++s)
+            {
+                CovariateTrackBlock &block = track.blocks[2 * contigId + s];
+                std::memcpy(&block.offset, track.data + p + 4 + s * 16, 8);
+                std::memcpy(&block.nRuns, track.data + p + 4 + s * 16 + 8, 4);
+                std::memcpy(&block.nValues, track.data + p + 4 + s * 16 + 12, 4);
+                size_t blockSize = 8 * (size_t)block.nRuns + 4 * (size_t)block.nValues;
+                if (track.flags & COV_TRACK_MOTIF_IDS)
+                    blockSize += block.nValues;
+                if (block.offset + blockSize > track.fileSize)
+                {
+                    std::cerr << "ERROR: Covariate track " << fileName << " is truncated.\n";
+                    return false;
+                }
+            }
+        }
+        p += 36;
+    }
+    return true;
+}
+
+
+// block of strand s of contig, NULL if contig is not contained in track
+inline CovariateTrackBlock const * getCovariateTrackBlock(CovariateTrack const &track, unsigned contigId, unsigned s)
+{
+    if (track.contigLengths[contigId] < 0)
+        return NULL;
+    return &track.blocks[2 * contigId + s];
+}
+
+inline void getCovariateTrackRun(unsigned &runBegin, unsigned &runEnd, CovariateTrack const &track, CovariateTrackBlock const &block, unsigned r)
+{
+    __uint32 run[2];
+    std::memcpy(run, track.data + block.offset + 8 * (size_t)r, 8);
+    runBegin = run[0];
+    runEnd = run[1];
+}
+
+inline float getCovariateTrackValue(CovariateTrack const &track, CovariateTrackBlock const &block, unsigned k)
+{
+    float value;
+    std::memcpy(&value, track.data + block.offset + 8 * (size_t)block.nRuns + 4 * (size_t)k, 4);
+    return value;
+}
+
+// 1-based motif id, 0 if track has no motif ids
+inline unsigned getCovariateTrackMotifId(CovariateTrack const &track, CovariateTrackBlock const &block, unsigned k)
+{
+    if (!(track.flags & COV_TRACK_MOTIF_IDS))
+        return 0;
+    return static_cast<__uint8>(track.data[block.offset + 8 * (size_t)block.nRuns + 4 * (size_t)block.nValues + k]);
+}
+
+// open covariates file given for -is or -fis: binary track (.pcov) or BED file
+template <typename TStore>
+bool loadCovariateSource(CovariateSource &source, CharString const &fileName, TStore &store, AppOptions &options)
+{
+    source.isTrack = isCovariateTrackFile(fileName);
+    if (source.isTrack)
+        return openCovariateTrack(source.track, fileName, store);
+    return loadCovariateIndex(source.index, fileName, store, options);
+}
+
+
+template <typename TValue>
+inline void writeTrackRaw(std::ofstream &out, TValue const &value)
+{
+    out.write(reinterpret_cast<char const *>(&value), sizeof(TValue));
+}
+
+struct CovariateTrackStrandData
+{
+    String<__uint32>    runs;
+    String<float>       values;
+    String<__uint8>     motifIds;
+};
+
+inline bool recordBeginLess(CovariateRecord const &a, CovariateRecord const &b)
+{
+    return a.beginPos < b.beginPos;
+}
+
+// rasterize records of one strand: overlapping records are merged into one run keeping the max. value
+// for motif scores negative scores are set to 0
+inline void rasterizeCovariates(CovariateTrackStrandData &strandData, String<CovariateRecord> &records, unsigned contigLength, bool motifs)
+{
+    std::sort(begin(records, Standard()), end(records, Standard()), recordBeginLess);
+    String<float> raster;
+    String<__uint8> rasterIds;
+    unsigned r = 0;
+    while (r < length(records))
+    {
+        // cluster of overlapping records
+        int runBegin = std::max(records[r].beginPos, (__int32)0);
+        int runEnd = std::min(records[r].endPos, (__int32)contigLength);
+        unsigned rEnd = r + 1;
+        while (rEnd < length(records) && records[rEnd].beginPos < runEnd)
+        {
+            runEnd = std::max(runEnd, std::min(records[rEnd].endPos, (__int32)contigLength));
+            ++rEnd;
+        }
+        if (runBegin >= runEnd)
+        {
+            r = rEnd;
+            continue;
+        }
+
+        clear(raster);
+        clear(rasterIds);
+        resize(raster, runEnd - runBegin, (motifs) ? 0.0f : -std::numeric_limits<float>::infinity(), Exact());
+        resize(rasterIds, runEnd - runBegin, 0, Exact());
+        for (; r < rEnd; ++r)
+        {
+            float value = records[r].score;
+            if (motifs)
+                value = std::max(value, 0.0f);         // ignore negative scores for the moment
+            for (int t = std::max(records[r].beginPos, runBegin); t < std::min(records[r].endPos, runEnd); ++t)
+            {
+                if (value > raster[t - runBegin])
+                {
+                    raster[t - runBegin] = value;
+                    rasterIds[t - runBegin] = records[r].id;
+                }
+            }
+        }
+        appendValue(strandData.runs, runBegin);
+        appendValue(strandData.runs, runEnd);
+        append(strandData.values, raster);
+        if (motifs)
+            append(strandData.motifIds, rasterIds);
+    }
+}
+
+// write rasterized covariates of all contigs (2 strand blocks per contig) into binary track
+template <typename TStore>
+bool writeCovariateTrack(CharString const &fileName, String<CovariateTrackStrandData> const &strandData, TStore &store, __uint32 flags, unsigned maxMotifId, unsigned bandwidth, __uint32 kernel, __uint32 kdeEngine)
+{
+    std::ofstream out(toCString(fileName), std::ios::binary | std::ios::out);
+    if (!out.good())
+    {
+        std::cerr << "ERROR: Could not open " << fileName << " for writing.\n";
+        return false;
+    }
+    out.write(COV_TRACK_MAGIC, 8);
+    writeTrackRaw(out, COV_TRACK_VERSION);
+    writeTrackRaw(out, flags);
+    writeTrackRaw(out, (__uint32)maxMotifId);
+    writeTrackRaw(out, (__uint32)length(store.contigNameStore));
+    writeTrackRaw(out, (__uint32)bandwidth);
+    writeTrackRaw(out, kernel);
+    writeTrackRaw(out, kdeEngine);
+
+    __uint64 offset = 36;
+    for (unsigned contigId = 0; contigId < length(store.contigNameStore); ++contigId)
+        offset += 4 + length(store.contigNameStore[contigId]) + 36;
+    for (unsigned contigId = 0; contigId < length(store.contigNameStore); ++contigId)
+    {
+        writeTrackRaw(out, (__uint32)length(store.contigNameStore[contigId]));
+        out.write(toCString(store.contigNameStore[contigId]), length(store.contigNameStore[contigId]));
+        writeTrackRaw(out, (__uint32)getContigLength(store, contigId));
+        for (unsigned s = 0; s < 2; ++s)
+        {
+            CovariateTrackStrandData const &d = strandData[2 * contigId + s];
+            writeTrackRaw(out, offset);
+            writeTrackRaw(out, (__uint32)(length(d.runs) / 2));
+            writeTrackRaw(out, (__uint32)length(d.values));
+            offset += 4 * (__uint64)length(d.runs) + 4 * (__uint64)length(d.values) + length(d.motifIds);
+        }
+    }
+    for (unsigned k = 0; k < length(strandData); ++k)
+    {
+        CovariateTrackStrandData const &d = strandData[k];
+        out.write(reinterpret_cast<char const *>(begin(d.runs, Standard())), 4 * length(d.runs));
+        out.write(reinterpret_cast<char const *>(begin(d.values, Standard())), 4 * length(d.values));
+        out.write(reinterpret_cast<char const *>(begin(d.motifIds, Standard())), length(d.motifIds));
+    }
+    out.close();
+    if (!out.good())
+    {
+        std::cerr << "ERROR: Could not write " << fileName << ".\n";
+        return false;
+    }
+    return true;
+}
+
+// convert covariate records of BED file into binary track, for motif scores only motif ids <= maxMotifId are kept
+template <typename TStore>
+bool writeCovariateTrack(CharString const &fileName, CovariateIndex &covIndex, TStore &store, bool motifs, unsigned maxMotifId)
+{
+    String<CovariateTrackStrandData> strandData;
+    resize(strandData, 2 * length(store.contigNameStore));
+    for (unsigned contigId = 0; contigId < length(store.contigNameStore); ++contigId)
+    {
+        String<CovariateRecord> records[2];
+        for (unsigned r = 0; r < length(covIndex.contigRecords[contigId]); ++r)
+        {
+            CovariateRecord const &record = covIndex.contigRecords[contigId][r];
+            if (motifs && (record.id < 1 || record.id > (int)maxMotifId || record.id > 255))
+                continue;
+            appendValue(records[(record.strand == '+') ? 0 : 1], record);
+        }
+        clear(covIndex.contigRecords[contigId]);
+        for (unsigned s = 0; s < 2; ++s)
+            rasterizeCovariates(strandData[2 * contigId + s], records[s], getContigLength(store, contigId), motifs);
+    }
+
+    return writeCovariateTrack(fileName, strandData, store, (motifs) ? COV_TRACK_MOTIF_IDS : (__uint32)0, maxMotifId, 0, 0, 0);
+}
+
+#endif
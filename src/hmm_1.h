@@ -34,6 +34,7 @@
 #include "density_functions_reg.h"
 #include "density_functions_crosslink.h"
 #include "density_functions_crosslink_reg.h"
+#include "bed_writer.h"
 #include <math.h>  
 
 using namespace seqan;
@@ -1601,215 +1602,263 @@ void HMM<TD1, TD2, TB1, TB2>::posteriorDecoding(String<String<String<__uint8> >
 
 
 
-void writeStates(BedFileOut &outBed,
-                 Data &data,
-                 FragmentStore<> &store, 
-                 unsigned contigId,
-                 AppOptions &options)          
-{  
-    for (unsigned s = 0; s < 2; ++s)
+// crosslink site (not truncation site) of t
+inline int getSitePos(Data &data, ReferenceStore &store, unsigned contigId, unsigned s, unsigned i, unsigned t)
+{
+    if (s == 0)
+        return t + data.setPos[s][i] - 1;
+    return getContigLength(store, contigId) - (t + data.setPos[s][i]);
+}
+
+
+// crosslink site: state 3 with score of at least minSiteScore
+inline bool isCrosslinkSite(Data &data, unsigned s, unsigned i, unsigned t, AppOptions &options)
+{
+    return data.states[s][i][t] == 3 && (options.minSiteScore <= 0.0 || getStateScore(data, s, i, t) >= options.minSiteScore);
+}
+
+inline bool isOutputSite(Data &data, unsigned s, unsigned i, unsigned t, AppOptions &options)
+{
+    return (options.outputAll && data.setObs[s][i].truncCounts[t] >= 1) || isCrosslinkSite(data, s, i, t, options);
+}
+
+// walks over sites of one strand in ascending genomic order:
+// forward strand intervals and t ascending, reverse strand (stored reversed) descending
+struct SiteCursor
+{
+    unsigned    s;
+    unsigned    n;      // no. of intervals passed
+    unsigned    m;      // no. of positions passed within interval
+    unsigned    i;
+    unsigned    t;
+    int         pos;
+    bool        atEnd;
+};
+
+// move to next site at or after current position for which accept(s, i, t) is true
+template <typename TAccept>
+inline void findSite(SiteCursor &c, Data &data, ReferenceStore &store, unsigned contigId, TAccept const &accept)
+{
+    unsigned nIntervals = length(data.states[c.s]);
+    while (c.n < nIntervals)
     {
-        for (unsigned i = 0; i < length(data.states[s]); ++i)
+        unsigned i = (c.s == 0) ? c.n : nIntervals - 1 - c.n;
+        unsigned len = length(data.states[c.s][i]);
+        while (c.m < len)
         {
-            for (unsigned t = 0; t < length(data.states[s][i]); ++t)
+            unsigned t = (c.s == 0) ? c.m : len - 1 - c.m;
+            if (accept(c.s, i, t))
             {
-                if (options.outputAll && data.setObs[s][i].truncCounts[t] >= 1)
-                {
-                    BedRecord<Bed6> record;
+                c.i = i;
+                c.t = t;
+                c.pos = getSitePos(data, store, contigId, c.s, i, t);
+                return;
+            }
+            ++c.m;
+        }
+        ++c.n;
+        c.m = 0;
+    }
+    c.atEnd = true;
+}
 
-                    record.ref = store.contigNameStore[contigId];
-                    if (s == 0)         // crosslink sites (not truncation site)
-                    {
-                        record.beginPos = t + data.setPos[s][i] - 1;
-                        record.endPos = record.beginPos + 1;
-                    }
-                    else
-                    {
-                        record.beginPos = length(store.contigStore[contigId].seq) - (t + data.setPos[s][i]) ;
-                        record.endPos = record.beginPos + 1;
-                    }
+template <typename TAccept>
+inline void init(SiteCursor &c, unsigned s, Data &data, ReferenceStore &store, unsigned contigId, TAccept const &accept)
+{
+    c.s = s;
+    c.n = 0;
+    c.m = 0;
+    c.atEnd = false;
+    findSite(c, data, store, contigId, accept);
+}
 
-                    std::stringstream ss;
-                    ss << (int)data.states[s][i][t];
-                    record.name = ss.str();
-                    ss.str("");  
-                    ss.clear();  
+// cursor of strand with next site in genomic order, NULL if both at end
+inline SiteCursor * nextCursor(SiteCursor &cF, SiteCursor &cR)
+{
+    if (cF.atEnd && cR.atEnd)
+        return NULL;
+    if (cR.atEnd || (!cF.atEnd && cF.pos <= cR.pos))
+        return &cF;
+    return &cR;
+}
 
-                    // log posterior prob. ratio score
-                    double secondBest = 0.0;
-                    for (unsigned k = 0; k < 4; ++k)
-                    {
-                        if (k != (unsigned)data.states[s][i][t] && data.statePosteriors[s][k][i][t] > secondBest)
-                            secondBest = data.statePosteriors[s][k][i][t];
-                    }                    
-                    ss << (double)log(data.statePosteriors[s][data.states[s][i][t]][i][t] / std::max(secondBest, DBL_MIN) );
-
-                    record.score = ss.str();
-                    ss.str("");  
-                    ss.clear();  
-                    if (s == 0)
-                        record.strand = '+';
-                    else
-                        record.strand = '-';
-
-                    ss << 0;
-                    ss << ";";
-                    ss << (int)data.setObs[s][i].truncCounts[t];
-                    ss << ";";
-                    ss << (int)data.setObs[s][i].nEstimates[t];
-                    ss << ";";
-                    ss << (double)data.setObs[s][i].kdes[t];
-                    ss << ";";
-
-                    ss << (double)data.statePosteriors[s][3][i][t];
-                    ss << ";"; 
-                    if (options.useCov_RPKM)
-                        ss << (double)data.setObs[s][i].rpkms[t];
-                    else
-                        ss << 0.0;
-                    ss << ";";
-                    ss << (double)log((data.statePosteriors[s][2][i][t] + data.statePosteriors[s][3][i][t])/(data.statePosteriors[s][0][i][t] + data.statePosteriors[s][1][i][t]));
-                    ss << ";";
-
-                    record.data = ss.str();
-                    ss.str("");  
-                    ss.clear();  
-
-                    writeRecord(outBed, record);
-                }
-                else if (data.states[s][i][t] == 3)
-                {
-                    BedRecord<Bed6> record;
+struct OutputSiteAccept
+{
+    Data &data;
+    AppOptions &options;
 
-                    record.ref = store.contigNameStore[contigId];
-                    if (s == 0)         // crosslink sites (not truncation site)
-                    {
-                        record.beginPos = t + data.setPos[s][i] - 1;
-                        record.endPos = record.beginPos + 1;
-                    }
-                    else
-                    {
-                        record.beginPos = length(store.contigStore[contigId].seq) - (t + data.setPos[s][i]);
-                        record.endPos = record.beginPos + 1;
-                    }
+    OutputSiteAccept(Data &data_, AppOptions &options_) : data(data_), options(options_) {}
+    bool operator()(unsigned s, unsigned i, unsigned t) const { return isOutputSite(data, s, i, t, options); }
+};
 
-                    std::stringstream ss;
-                    ss << (int)data.states[s][i][t];
-                    record.name = ss.str();
-                    ss.str("");  
-                    ss.clear();  
 
-                    // log posterior prob. ratio score
-                    double secondBest = 0.0;
-                    for (unsigned k = 0; k < 4; ++k)
-                    {
-                        if (k != (unsigned)data.states[s][i][t] && data.statePosteriors[s][k][i][t] > secondBest)
-                            secondBest = data.statePosteriors[s][k][i][t];
-                    }                    
-                    ss << (double)log(data.statePosteriors[s][data.states[s][i][t]][i][t] / std::max(secondBest, DBL_MIN) );
-
-                    record.score = ss.str();
-                    ss.str("");  
-                    ss.clear();  
-                    if (s == 0)
-                        record.strand = '+';
-                    else
-                        record.strand = '-';
-
-                    writeRecord(outBed, record);
-                }               
-            }
+inline void writeSite(BedWriter &outBed, Data &data, ReferenceStore &store, unsigned contigId, SiteCursor const &c, AppOptions &options)
+{
+    unsigned s = c.s;
+    unsigned i = c.i;
+    unsigned t = c.t;
+    appendBedPos(outBed, store.contigNameStore[contigId], c.pos, c.pos + 1);
+    appendNumber(outBed, (int)data.states[s][i][t]);
+    appendChar(outBed, '\t');
+    appendNumber(outBed, getStateScore(data, s, i, t));
+    appendChar(outBed, '\t');
+    appendChar(outBed, (s == 0) ? '+' : '-');
+    if (options.outputAll && data.setObs[s][i].truncCounts[t] >= 1)
+    {
+        appendChars(outBed, "\t0;", 3);
+        appendNumber(outBed, (int)data.setObs[s][i].truncCounts[t]);
+        appendChar(outBed, ';');
+        appendNumber(outBed, (int)data.setObs[s][i].nEstimates[t]);
+        appendChar(outBed, ';');
+        appendNumber(outBed, (double)data.setObs[s][i].kdes[t]);
+        appendChar(outBed, ';');
+        appendNumber(outBed, (double)data.statePosteriors[s][3][i][t]);
+        appendChar(outBed, ';');
+        if (options.useCov_RPKM)
+            appendNumber(outBed, (double)data.setObs[s][i].rpkms[t]);
+        else
+            appendNumber(outBed, 0.0);
+        appendChar(outBed, ';');
+        appendNumber(outBed, getEnrichmentScore(data, s, i, t));
+        appendChar(outBed, ';');
+    }
+    appendChar(outBed, '\n');
+}
+
+// sites of both strands merged by position, output is coordinate-sorted
+void writeStates(BedWriter &outBed,
+                 Data &data,
+                 ReferenceStore &store, 
+                 unsigned contigId,
+                 AppOptions &options)          
+{  
+    OutputSiteAccept accept(data, options);
+    SiteCursor cF;
+    SiteCursor cR;
+    init(cF, 0, data, store, contigId, accept);
+    init(cR, 1, data, store, contigId, accept);
+    for (SiteCursor * c = nextCursor(cF, cR); c != NULL; c = nextCursor(cF, cR))
+    {
+        writeSite(outBed, data, store, contigId, *c, options);
+        ++c->m;
+        findSite(*c, data, store, contigId, accept);
+    }
+}
+
+
+// binding region: crosslink sites of one interval within distMerge of each other
+struct BindingRegion
+{
+    int             beginPos;
+    int             endPos;
+    double          scoresSum;
+    std::string     indivScores;
+};
+
+// region starting at crosslink site t of interval i, t is moved to the last position examined
+// sites are visited in interval order (t ascending), as regions are defined on the stored strand
+inline void getRegion(BindingRegion &region, Data &data, ReferenceStore &store, unsigned contigId, unsigned s, unsigned i, unsigned &t, AppOptions &options)
+{
+    char scoreBuffer[32];
+    region.beginPos = getSitePos(data, store, contigId, s, i, t);
+    region.endPos = region.beginPos + 1;
+
+    unsigned prev_cs = t;
+    double score = getStateScore(data, s, i, t);
+    region.scoresSum = score;
+    int n = std::snprintf(scoreBuffer, sizeof(scoreBuffer), "%g;", score);
+    region.indivScores.assign(scoreBuffer, std::max(n, 0));
+    while ((t+1) < length(data.states[s][i]) && (t+1-prev_cs) <= options.distMerge)
+    {
+        ++t;
+        if (isCrosslinkSite(data, s, i, t, options))
+        {
+            if (s == 0)         // crosslink sites (not truncation site)
+                region.endPos = t + data.setPos[s][i] - 1;
+            else
+                region.beginPos = getContigLength(store, contigId) - (t + data.setPos[s][i]);
+
+            score = getStateScore(data, s, i, t);
+            region.scoresSum += score;
+            n = std::snprintf(scoreBuffer, sizeof(scoreBuffer), "%g;", score);
+            region.indivScores.append(scoreBuffer, std::max(n, 0));
+            prev_cs = t;
         }
     }
 }
 
+inline void writeRegion(BedWriter &outBed, BindingRegion const &region, ReferenceStore &store, unsigned contigId, char strand)
+{
+    appendBedPos(outBed, store.contigNameStore[contigId], region.beginPos, region.endPos);
+    appendChars(outBed, region.indivScores.data(), region.indivScores.size());
+    appendChar(outBed, '\t');
+    appendNumber(outBed, region.scoresSum);
+    appendChar(outBed, '\t');
+    appendChar(outBed, strand);
+    appendChar(outBed, '\n');
+}
 
-void writeRegions(BedFileOut &outBed,
+// regions of both strands merged by begin position, output is coordinate-sorted
+// forward regions are streamed, reverse regions of each interval are built in stored order and written backwards
+void writeRegions(BedWriter &outBed,
                  Data &data,
-                 FragmentStore<> &store, 
+                 ReferenceStore &store, 
                  unsigned contigId,
                  AppOptions &options)          
 {  
-    for (unsigned s = 0; s < 2; ++s)
+    std::vector<BindingRegion> regionsR;     // reverse strand regions of current interval, descending positions
+    unsigned nR = length(data.states[1]);
+    unsigned iR = 0;       // no. of reverse intervals passed, ascending genomic order
+    unsigned i = 0;
+    unsigned t = 0;
+    BindingRegion regionF;
+    bool hasF = false;
+    while (true)
     {
-        for (unsigned i = 0; i < length(data.states[s]); ++i)
+        // next forward region
+        while (!hasF && i < length(data.states[0]))
         {
-            for (unsigned t = 0; t < length(data.states[s][i]); ++t)
+            for (; t < length(data.states[0][i]); ++t)
             {
-                if (data.states[s][i][t] == 3)
+                if (isCrosslinkSite(data, 0, i, t, options))
                 {
-                    BedRecord<Bed6> record;
-                    record.ref = store.contigNameStore[contigId];
-                    if (s == 0)         // crosslink sites (not truncation site)
-                    {
-                        record.beginPos = t + data.setPos[s][i] - 1;
-                        record.endPos = record.beginPos + 1;
-                    }
-                    else
-                    {
-                        record.beginPos = length(store.contigStore[contigId].seq) - (t + data.setPos[s][i]);
-                        record.endPos = record.beginPos + 1;
-                    }
-
-                    std::stringstream ss;
-
-                    // log posterior prob. ratio score
-                    double secondBest = 0.0;
-                    for (unsigned k = 0; k < 4; ++k)
-                    {
-                        if (k != (unsigned)data.states[s][i][t] && data.statePosteriors[s][k][i][t] > secondBest)
-                            secondBest = data.statePosteriors[s][k][i][t];
-                    }                    
-                    ss << (double)log(data.statePosteriors[s][data.states[s][i][t]][i][t] / std::max(secondBest, DBL_MIN) );
-                    record.score = ss.str();
-                    ss.str("");  
-                    ss.clear();  
-                    if (s == 0)
-                        record.strand = '+';
-                    else
-                        record.strand = '-';
-
-                    unsigned prev_cs = t;
-                    double scoresSum = (double)log(data.statePosteriors[s][data.states[s][i][t]][i][t] / std::max(secondBest, DBL_MIN) );
-                    std::stringstream ss_indivScores;
-                    ss_indivScores << (double)log(data.statePosteriors[s][data.states[s][i][t]][i][t] / std::max(secondBest, DBL_MIN) ) << ';';
-                    while ((t+1) < length(data.states[s][i]) && (t+1-prev_cs) <= options.distMerge)
-                    {
-                        ++t;
-                        if (data.states[s][i][t] == 3)
-                        {
-                            if (s == 0)         // crosslink sites (not truncation site)
-                            {
-                                record.endPos = t + data.setPos[s][i] - 1;
-                            }
-                            else
-                            {
-                                record.beginPos = length(store.contigStore[contigId].seq) - (t + data.setPos[s][i]);
-                            }
-
-                            // log posterior prob. ratio score
-                            double secondBest = 0.0;
-                            for (unsigned k = 0; k < 4; ++k)
-                            {
-                                if (k != (unsigned)data.states[s][i][t] && data.statePosteriors[s][k][i][t] > secondBest)
-                                    secondBest = data.statePosteriors[s][k][i][t];
-                            }                   
-
-                            scoresSum += (double)log(data.statePosteriors[s][data.states[s][i][t]][i][t] / std::max(secondBest, DBL_MIN) );
-                            ss_indivScores << (double)log(data.statePosteriors[s][data.states[s][i][t]][i][t] / std::max(secondBest, DBL_MIN) ) << ';';
-                            prev_cs = t;
-                        }
-                    }
-                    ss << scoresSum;
-                    record.score = ss.str();
-                    ss.str("");  
-                    ss.clear(); 
-                    record.name = ss_indivScores.str();
-                    ss_indivScores.str("");  
-                    ss_indivScores.clear(); 
-                    writeRecord(outBed, record);
-                }      
+                    getRegion(regionF, data, store, contigId, 0, i, t, options);
+                    ++t;
+                    hasF = true;
+                    break;
+                }
             }
+            if (!hasF)
+            {
+                ++i;
+                t = 0;
+            }
+        }
+        // regions of next reverse interval
+        while (regionsR.empty() && iR < nR)
+        {
+            unsigned k = nR - 1 - iR;
+            for (unsigned tR = 0; tR < length(data.states[1][k]); ++tR)
+            {
+                if (isCrosslinkSite(data, 1, k, tR, options))
+                {
+                    regionsR.push_back(BindingRegion());
+                    getRegion(regionsR.back(), data, store, contigId, 1, k, tR, options);
+                }
+            }
+            ++iR;
+        }
+        if (!hasF && regionsR.empty())
+            break;
+        if (regionsR.empty() || (hasF && regionF.beginPos <= regionsR.back().beginPos))
+        {
+            writeRegion(outBed, regionF, store, contigId, '+');
+            hasF = false;
+        }
+        else
+        {
+            writeRegion(outBed, regionsR.back(), store, contigId, '-');
+            regionsR.pop_back();
         }
     }
 }
@@ -0,0 +1,141 @@
+// ======================================================================
+// PureCLIP: capturing target-specific protein-RNA interaction footprints
+// ======================================================================
+// Copyright (C) 2017  Sabrina Krakau, Max Planck Institute for Molecular
+// Genetics
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// =======================================================================
+// Author: Sabrina Krakau <krakau@molgen.mpg.de>
+// =======================================================================
+
+
+#ifndef APPS_HMMS_KDE_SIMD_H_
+#define APPS_HMMS_KDE_SIMD_H_
+
+// Vectorized kernels for KDE computation, selected at runtime by CPU features (AVX-512, AVX2 or scalar),
+// hence one binary for all machines. Multiplication and addition must not be fused (FP contraction is disabled
+// for these functions), results are identical for all variants (asserted against scalar variant in debug builds).
+// Only the double precision scatter of the sparse engine is vectorized, accumulation in float is not used
+// (KDEs are compared to the singleton threshold K(0)/h and log-transformed).
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KDE_SIMD_X86 1
+#include <immintrin.h>
+#else
+#define KDE_SIMD_X86 0
+#endif
+
+
+#if defined(__clang__)
+#pragma clang fp contract(off)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+// out[k] += factor * profile[k] for k < n
+inline void addScaledProfileScalar(double * out, double const * profile, double factor, unsigned n)
+{
+    for (unsigned k = 0; k < n; ++k)
+        out[k] += factor * profile[k];
+}
+
+#if KDE_SIMD_X86
+__attribute__((target("avx2")))
+inline void addScaledProfileAvx2(double * out, double const * profile, double factor, unsigned n)
+{
+    __m256d vFactor = _mm256_set1_pd(factor);
+    unsigned k = 0;
+    for (; k + 4 <= n; k += 4)
+        _mm256_storeu_pd(out + k, _mm256_add_pd(_mm256_loadu_pd(out + k), _mm256_mul_pd(vFactor, _mm256_loadu_pd(profile + k))));
+    for (; k < n; ++k)
+        out[k] += factor * profile[k];
+}
+
+__attribute__((target("avx512f")))
+inline void addScaledProfileAvx512(double * out, double const * profile, double factor, unsigned n)
+{
+    __m512d vFactor = _mm512_set1_pd(factor);
+    unsigned k = 0;
+    for (; k + 8 <= n; k += 8)
+        _mm512_storeu_pd(out + k, _mm512_add_pd(_mm512_loadu_pd(out + k), _mm512_mul_pd(vFactor, _mm512_loadu_pd(profile + k))));
+    for (; k < n; ++k)
+        out[k] += factor * profile[k];
+}
+#endif
+
+#if !defined(__clang__) && defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+typedef void (*TAddScaledProfile)(double *, double const *, double, unsigned);
+
+// true if variant gives exactly the same results as scalar variant, e.g. no fused multiply-add
+inline bool matchesScalar(TAddScaledProfile addScaledProfile)
+{
+    unsigned const n = 61;          // not a multiple of vector width: tail is checked too
+    double profile[n];
+    double expected[n];
+    double out[n];
+    for (unsigned k = 0; k < n; ++k)
+    {
+        profile[k] = 1.0 / (double)(k + 3);
+        expected[k] = out[k] = 0.1 * (double)k + 1.0 / 7.0;
+    }
+    for (unsigned j = 0; j < 5; ++j)
+    {
+        double factor = (double)(j + 1) / 3.0;
+        addScaledProfileScalar(expected + j, profile, factor, n - j);
+        addScaledProfile(out + j, profile, factor, n - j);
+    }
+    for (unsigned k = 0; k < n; ++k)
+        if (out[k] != expected[k])
+            return false;
+    return true;
+}
+
+struct KdeKernels
+{
+    TAddScaledProfile   addScaledProfile;
+    char const *        name;
+
+    KdeKernels() : addScaledProfile(addScaledProfileScalar), name("scalar")
+    {
+#if KDE_SIMD_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+        {
+            addScaledProfile = addScaledProfileAvx512;
+            name = "AVX-512";
+        }
+        else if (__builtin_cpu_supports("avx2"))
+        {
+            addScaledProfile = addScaledProfileAvx2;
+            name = "AVX2";
+        }
+#endif
+        SEQAN_ASSERT(matchesScalar(addScaledProfile));
+    }
+};
+
+// selected once
+inline KdeKernels const & kdeKernels()
+{
+    static KdeKernels kernels;
+    return kernels;
+}
+
+#endif
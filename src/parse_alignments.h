@@ -26,34 +26,189 @@
 
 #include <iostream>
 #include <fstream>
+#include <cstring>
+
+#include "bgzf_parallel.h"
 
 using namespace seqan;
 
 
+// Alignment record reduced to the fields needed to count read starts
+// raw record buffer is reused, hence no allocations per record
+struct BamAlignmentRecordLight
+{
+    __int32     rID;
+    __int32     beginPos;
+    __uint16    flag;
+    unsigned    lengthInRef;
+    CharString  buffer;
+
+    BamAlignmentRecordLight() : rID(-1), beginPos(-1), flag(0), lengthInRef(0) {}
+};
+
+inline bool hasFlagRC(BamAlignmentRecordLight const &record)
+{
+    return (record.flag & BAM_FLAG_RC) != 0;
+}
+
+inline unsigned getAlignmentLengthInRef(BamAlignmentRecordLight const &record)
+{
+    return record.lengthInRef;
+}
+
+// Decode fixed-length part of raw BAM record and CIGAR operations, skip read name, sequence, qualities and tags
+template <typename TForwardIter>
+inline void readRecordLight(BamAlignmentRecordLight &record, TForwardIter &iter)
+{
+    __int32 recordLen = 0;
+    readRawPod(recordLen, iter);
+    clear(record.buffer);
+    write(record.buffer, iter, (size_t)recordLen);
+    if (recordLen < 32)
+        SEQAN_THROW(ParseError("BAM record is too short."));
+
+    char const * raw = begin(record.buffer, Standard());
+    __uint8 lReadName;
+    __uint16 nCigarOp;
+    std::memcpy(&record.rID, raw, 4);
+    std::memcpy(&record.beginPos, raw + 4, 4);
+    std::memcpy(&lReadName, raw + 8, 1);
+    std::memcpy(&nCigarOp, raw + 12, 2);
+    std::memcpy(&record.flag, raw + 14, 2);
+    if (32 + lReadName + 4 * nCigarOp > recordLen)
+        SEQAN_THROW(ParseError("BAM record is too short."));
+
+    // reference consuming operations: M, D, N, =, X
+    record.lengthInRef = 0;
+    char const * cigar = raw + 32 + lReadName;
+    for (unsigned i = 0; i < nCigarOp; ++i)
+    {
+        __uint32 op;
+        std::memcpy(&op, cigar + 4 * i, 4);
+        unsigned opType = op & 15;
+        if (opType == 0 || opType == 2 || opType == 3 || opType == 7 || opType == 8)
+            record.lengthInRef += op >> 4;
+    }
+}
+
+inline void readRecord(BamAlignmentRecordLight &record, BamFileIn &inFile)
+{
+    readRecordLight(record, inFile.iter);
+}
+
+
+// BAM input with BGZF blocks inflated ahead by worker threads
+// provides the subset of the BamFileIn interface used for parsing
+struct ParallelBamFileIn
+{
+    typedef BamIOContext<>                                  TBamContext;
+    typedef DirectionIterator<std::istream, Input>::Type    TIter;
+
+    BgzfParallelStreamBuf   streamBuf;
+    std::istream            stream;
+    TIter                   iter;
+    TBamContext             bamContext;
+    unsigned                numThreads;
+
+    ParallelBamFileIn(unsigned numThreads_) : stream(&streamBuf), numThreads(numThreads_) {}
+};
+
+inline bool open(ParallelBamFileIn &inFile, char const * fileName)
+{
+    if (!inFile.streamBuf.open(fileName, inFile.numThreads))
+        return false;
+    inFile.iter = directionIterator(inFile.stream, Input());
+    return true;
+}
+
+inline ParallelBamFileIn::TBamContext & context(ParallelBamFileIn &inFile)
+{
+    return inFile.bamContext;
+}
+
+inline bool atEnd(ParallelBamFileIn &inFile)
+{
+    return atEnd(inFile.iter);
+}
+
+inline void readHeader(BamHeader &header, ParallelBamFileIn &inFile)
+{
+    readHeader(header, inFile.bamContext, inFile.iter, Bam());
+}
+
+inline void readRecord(BamAlignmentRecord &record, ParallelBamFileIn &inFile)
+{
+    readRecord(record, inFile.bamContext, inFile.iter, Bam());
+}
+
+inline void readRecord(BamAlignmentRecordLight &record, ParallelBamFileIn &inFile)
+{
+    readRecordLight(record, inFile.iter);
+}
+
+// corrupt or truncated BGZF block: stream ends there as at end of file, has to be checked after parsing
+inline bool hasFailed(ParallelBamFileIn &inFile)
+{
+    return inFile.streamBuf.hasFailed();
+}
 
+// BamFileIn throws on read errors
+inline bool hasFailed(BamFileIn &)
+{
+    return false;
+}
+
+// Jump to first alignment overlapping [pos, posEnd) using the BAI linear index
+inline bool jumpToRegion(ParallelBamFileIn &inFile, bool &hasAlignments, int rID, int pos, int posEnd, BamIndex<Bai> const &baiIndex)
+{
+    hasAlignments = false;
+    if (rID < 0 || rID >= (int)length(baiIndex._linearIndices))
+        return false;
+
+    // linear index: smallest file offset of alignments overlapping 16kbp window, 0 if window is empty
+    String<__uint64> const & linearIndex = baiIndex._linearIndices[rID];
+    unsigned window = std::max(pos, 0) >> 14;
+    while (window < length(linearIndex) && linearIndex[window] == 0)
+        ++window;
+    if (window >= length(linearIndex))
+        return true;
+    if (!inFile.streamBuf.seekVirtual(linearIndex[window]))
+        return false;
+
+    // skip alignments ending before pos
+    BamAlignmentRecordLight bamRecord;
+    while (!atEnd(inFile))
+    {
+        __uint64 virtualOffset = inFile.streamBuf.tellVirtual();
+        readRecord(bamRecord, inFile);
+        if (bamRecord.rID == rID && bamRecord.beginPos + (int)getAlignmentLengthInRef(bamRecord) <= pos)
+            continue;
+
+        hasAlignments = (bamRecord.rID == rID && bamRecord.beginPos < posEnd);
+        return inFile.streamBuf.seekVirtual(virtualOffset);
+    }
+    return true;
+}
+
+
+
+// count read starts within [beginPos, endPos) of alignments beginning within [chunkBegin, chunkEnd)
 template <typename TContigObservations, typename TBamIn, typename TBai, typename TOptions>
-bool parse_bamRegion(TContigObservations &contigObservationsF, TContigObservations &contigObservationsR,  TBamIn &inFile, TBai &baiIndex, int const& rID, TOptions &options)
+bool parse_bamChunk(TContigObservations &contigObservationsF, TContigObservations &contigObservationsR,  TBamIn &inFile, TBai &baiIndex, int const& rID, unsigned beginPos, unsigned endPos, unsigned chunkBegin, unsigned chunkEnd, TOptions &options)
 {
-    if (options.verbosity >= 2)
-        std::cout << "Parse BAM region " << std::endl;
- 
-    int jump_beginPos = 0;
     // Jump the BGZF stream to this position.
     bool hasAlignments = false;
-    if (!jumpToRegion(inFile, hasAlignments, rID, jump_beginPos, length(contigObservationsF.truncCounts)-1, baiIndex))
+    unsigned jump_beginPos = std::max(beginPos, chunkBegin);
+    if (!jumpToRegion(inFile, hasAlignments, rID, jump_beginPos, chunkEnd, baiIndex))
     {
-        std::cerr << "ERROR: Could not jump to " << jump_beginPos << ":" << (length(contigObservationsF.truncCounts)-1) << "\n";
+        std::cerr << "ERROR: Could not jump to " << jump_beginPos << ":" << chunkEnd << "\n";
         return false;
     }
     if (!hasAlignments)
-    {
-        std::cout << "WARNING: no alignments here " << jump_beginPos << ":" << (length(contigObservationsF.truncCounts)-1) << "\n";
-        return false;  
-    }
+        return !hasFailed(inFile);
 
     // Seek linearly to the selected position
-    BamAlignmentRecord bamRecord;
-    BamAlignmentRecord newBamRecord;
+    BamAlignmentRecordLight bamRecord;
     while (!atEnd(inFile))
     {
         readRecord(bamRecord, inFile);
@@ -61,23 +216,115 @@ bool parse_bamRegion(TContigObservations &contigObservationsF, TContigObservatio
         // If we are on the next reference 
         if (bamRecord.rID == -1 || bamRecord.rID > rID)
             break;
+        if (bamRecord.beginPos >= (int)chunkEnd || bamRecord.beginPos >= (int)endPos)
+            break;
+        if (bamRecord.beginPos < (int)chunkBegin)       // counted within previous chunk
+            continue;
 
         if (!hasFlagRC(bamRecord))          // Forward
         {
-            if (contigObservationsF.truncCounts[bamRecord.beginPos] < 254)      // uint8, discard interval if > anyway ...
-                ++contigObservationsF.truncCounts[bamRecord.beginPos]; 
+            if (bamRecord.beginPos >= (int)beginPos)
+                addReadStart(contigObservationsF, bamRecord.beginPos);
         }
         else                                // Reverse  
         {
-            if (contigObservationsR.truncCounts[bamRecord.beginPos + getAlignmentLengthInRef(bamRecord) - 1] < 254)
-                ++contigObservationsR.truncCounts[bamRecord.beginPos + getAlignmentLengthInRef(bamRecord) - 1]; 
+            unsigned readStart = bamRecord.beginPos + getAlignmentLengthInRef(bamRecord) - 1;
+            if (readStart >= beginPos && readStart < endPos)
+                addReadStart(contigObservationsR, readStart);
         }
     }
+    if (hasFailed(inFile))
+    {
+        std::cerr << "ERROR: Could not read alignments within " << beginPos << ":" << endPos << ", BAM file is corrupt or truncated.\n";
+        return false;
+    }
+    finalize(contigObservationsF);
+    finalize(contigObservationsR);
     return true;
 }
 
+// count read starts within [beginPos, endPos)
+template <typename TContigObservations, typename TBamIn, typename TBai, typename TOptions>
+bool parse_bamRegion(TContigObservations &contigObservationsF, TContigObservations &contigObservationsR,  TBamIn &inFile, TBai &baiIndex, int const& rID, unsigned beginPos, unsigned endPos, TOptions &options)
+{
+    if (options.verbosity >= 2)
+        std::cout << "Parse BAM region " << std::endl;
+
+    if (!parse_bamChunk(contigObservationsF, contigObservationsR, inFile, baiIndex, rID, beginPos, endPos, 0, endPos, options))
+        return false;
+    if (empty(contigObservationsF.positions) && empty(contigObservationsR.positions))
+        std::cout << "WARNING: no alignments here " << beginPos << ":" << endPos << "\n";
+    return true;
+}
 
 
+// Part of a contig parsed independently: alignments beginning within [chunkBegin, chunkEnd)
+struct BamChunk
+{
+    unsigned    obsId;          // index of contigObservations to merge counts into
+    int         rID;
+    unsigned    contigLength;
+    unsigned    beginPos;       // count read starts within [beginPos, endPos)
+    unsigned    endPos;
+    unsigned    chunkBegin;
+    unsigned    chunkEnd;
+};
+
+// compressed BAM file size of alignments overlapping [beginPos, endPos), approximated using the BAI linear index
+inline __uint64 getBamRegionSize(BamIndex<Bai> const &baiIndex, int rID, unsigned beginPos, unsigned endPos)
+{
+    if (rID < 0 || rID >= (int)length(baiIndex._linearIndices) || beginPos >= endPos)
+        return 0;
+    String<__uint64> const & linearIndex = baiIndex._linearIndices[rID];
+    __uint64 first = 0;
+    __uint64 last = 0;
+    for (unsigned window = beginPos >> 14; window < length(linearIndex) && window <= ((endPos - 1) >> 14); ++window)
+    {
+        if (linearIndex[window] == 0)
+            continue;
+        if (first == 0)
+            first = linearIndex[window] >> 16;
+        last = linearIndex[window] >> 16;
+    }
+    return last - first;
+}
+
+// split [beginPos, endPos) at 16kbp windows of the BAI linear index into chunks of roughly chunkSize compressed bytes
+inline void appendBamChunks(String<BamChunk> &chunks, BamIndex<Bai> const &baiIndex, unsigned obsId, int rID, unsigned contigLength, unsigned beginPos, unsigned endPos, __uint64 chunkSize)
+{
+    BamChunk chunk;
+    chunk.obsId = obsId;
+    chunk.rID = rID;
+    chunk.contigLength = contigLength;
+    chunk.beginPos = beginPos;
+    chunk.endPos = endPos;
+    chunk.chunkBegin = 0;           // first chunk includes alignments beginning before beginPos
+
+    if (rID >= 0 && rID < (int)length(baiIndex._linearIndices) && beginPos < endPos)
+    {
+        String<__uint64> const & linearIndex = baiIndex._linearIndices[rID];
+        __uint64 chunkStart = 0;
+        for (unsigned window = beginPos >> 14; window < length(linearIndex) && window <= ((endPos - 1) >> 14); ++window)
+        {
+            if (linearIndex[window] == 0)
+                continue;
+            __uint64 offset = linearIndex[window] >> 16;
+            if (chunkStart == 0)
+            {
+                chunkStart = offset;
+            }
+            else if (offset - chunkStart >= chunkSize && (window << 14) > std::max(beginPos, chunk.chunkBegin))
+            {
+                chunk.chunkEnd = window << 14;
+                appendValue(chunks, chunk);
+                chunk.chunkBegin = chunk.chunkEnd;
+                chunkStart = offset;
+            }
+        }
+    }
+    chunk.chunkEnd = endPos;
+    appendValue(chunks, chunk);
+}
 
 template <typename TTruncCounts, typename TBamIn, typename TBai, typename TOptions>
 bool parse_bamRegion(TTruncCounts &truncCounts, TBamIn &inFile, TBai &baiIndex, int const& rID, unsigned beginPos, unsigned endPos, bool isForward, TOptions &options)
@@ -102,8 +349,7 @@ bool parse_bamRegion(TTruncCounts &truncCounts, TBamIn &inFile, TBai &baiIndex,
     }*/
 
     // Seek linearly to the selected position
-    BamAlignmentRecord bamRecord;
-    BamAlignmentRecord newBamRecord;
+    BamAlignmentRecordLight bamRecord;
     while (!atEnd(inFile))
     {
         readRecord(bamRecord, inFile);
@@ -133,10 +379,53 @@ bool parse_bamRegion(TTruncCounts &truncCounts, TBamIn &inFile, TBai &baiIndex,
             }
         }
     }
+    if (hasFailed(inFile))
+    {
+        std::cerr << "ERROR: Could not read alignments within " << beginPos << ":" << endPos << ", BAM file is corrupt or truncated.\n";
+        return false;
+    }
+    return true;
+}
+
+
+// Parse whole BAM file in one sequential pass
+// read starts are only counted for initialized contigs, reads of other contigs are skipped
+template <typename TContigObservations, typename TBamIn, typename TOptions>
+bool parse_bamAll(String<TContigObservations> &contigObservationsF, String<TContigObservations> &contigObservationsR, String<int> const &rIdToContigId, TBamIn &inFile, TOptions &options)
+{
+    if (options.verbosity >= 2)
+        std::cout << "Parse whole BAM file " << std::endl;
+
+    BamAlignmentRecordLight bamRecord;
+    while (!atEnd(inFile))
+    {
+        readRecord(bamRecord, inFile);
+
+        // unmapped reads are stored at the end of a sorted BAM file
+        if (bamRecord.rID == -1)
+            break;
+
+        int contigId = rIdToContigId[bamRecord.rID];
+        if (contigId < 0 || empty(contigObservationsF[contigId]))
+            continue;
 
+        if (!hasFlagRC(bamRecord))          // Forward
+            addReadStart(contigObservationsF[contigId], bamRecord.beginPos);
+        else                                // Reverse
+            addReadStart(contigObservationsR[contigId], bamRecord.beginPos + getAlignmentLengthInRef(bamRecord) - 1);
+    }
+    if (hasFailed(inFile))
+    {
+        std::cerr << "ERROR: Could not read alignments, BAM file is corrupt or truncated.\n";
+        return false;
+    }
+    for (unsigned contigId = 0; contigId < length(contigObservationsF); ++contigId)
+    {
+        finalize(contigObservationsF[contigId]);
+        finalize(contigObservationsR[contigId]);
+    }
     return true;
 }
 
 
-    
 #endif
@@ -0,0 +1,346 @@
+// ======================================================================
+// PureCLIP: capturing target-specific protein-RNA interaction footprints
+// ======================================================================
+// Copyright (C) 2017  Sabrina Krakau, Max Planck Institute for Molecular
+// Genetics
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// =======================================================================
+// Author: Sabrina Krakau <krakau@molgen.mpg.de>
+// =======================================================================
+
+#ifndef APPS_HMMS_POSTERIOR_FILE_H_
+#define APPS_HMMS_POSTERIOR_FILE_H_
+
+#include <iostream>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+using namespace seqan;
+
+// Binary per-position posteriors of all covered intervals (.ppost), memory-mappable
+//
+// header:  char[8] magic, uint32 version, uint32 flags
+// blocks:  one per contig with covered intervals, in contig order, 8-byte aligned:
+//          uint32 name length, name, padding,
+//          uint32 contig length, uint32 0,
+//          for F and R: uint32 no. of intervals, uint32 0, uint64 no. of positions,
+//          for F and R: uint32 setPos[nIntervals], uint32 interval lengths[nIntervals], padding,
+//                       columns of all positions of all intervals (concatenated in stored order):
+//                       float64 P(state 0..3) (4 columns), float64 score (log P(state)/P(second best state)),
+//                       float64 log enrichment ratio (log (P(2)+P(3))/(P(0)+P(1))), float64 KDE,
+//                       float64 covariate (0 if not used), uint16 N, uint8 state, uint8 read start count, padding
+// index:   uint64 file offset of each block
+// footer:  uint64 index offset, uint32 no. of blocks, uint32 version, char[8] magic
+//
+// Positions are stored as used by the HMM: forward strand site of interval i at t is setPos + t - 1,
+// reverse strand (stored reversed) site is contigLength - (setPos + t).
+// Values are not narrowed: scores of confident sites rely on posteriors far below float range (e.g. 1e-100),
+// and recall has to reproduce output of the original run exactly.
+
+static char const POSTERIOR_FILE_MAGIC[8] = {'P', 'C', 'L', 'I', 'P', 'P', 'S', 'T'};
+static __uint32 const POSTERIOR_FILE_VERSION = 1;
+static size_t const POSTERIOR_FILE_BYTES_PER_POS = 8 * 8 + 4;
+static __uint32 const POSTERIOR_FILE_COVARIATES = 1;
+
+template <typename TValue>
+inline void appendPosteriorRaw(std::string &out, TValue value)
+{
+    out.append(reinterpret_cast<char const *>(&value), sizeof(TValue));
+}
+
+inline void padPosteriorBlock(std::string &out)
+{
+    out.append((8 - out.size() % 8) % 8, '\0');
+}
+
+inline std::string getPosteriorFileHeader(AppOptions const &options)
+{
+    std::string header(POSTERIOR_FILE_MAGIC, 8);
+    appendPosteriorRaw(header, POSTERIOR_FILE_VERSION);
+    appendPosteriorRaw(header, (options.useCov_RPKM) ? POSTERIOR_FILE_COVARIATES : (__uint32)0);
+    return header;
+}
+
+// block of one contig, empty if contig has no covered intervals
+inline void appendPosteriorBlock(std::string &out, Data &data, ReferenceStore &store, unsigned contigId, AppOptions &options)
+{
+    if (empty(data.states[0]) && empty(data.states[1]))
+        return;
+
+    appendPosteriorRaw(out, (__uint32)length(store.contigNameStore[contigId]));
+    out.append(toCString(store.contigNameStore[contigId]), length(store.contigNameStore[contigId]));
+    padPosteriorBlock(out);
+    appendPosteriorRaw(out, (__uint32)getContigLength(store, contigId));
+    appendPosteriorRaw(out, (__uint32)0);
+    for (unsigned s = 0; s < 2; ++s)
+    {
+        __uint64 nPositions = 0;
+        for (unsigned i = 0; i < length(data.states[s]); ++i)
+            nPositions += length(data.states[s][i]);
+        appendPosteriorRaw(out, (__uint32)length(data.states[s]));
+        appendPosteriorRaw(out, (__uint32)0);
+        appendPosteriorRaw(out, nPositions);
+    }
+
+    for (unsigned s = 0; s < 2; ++s)
+    {
+        unsigned nIntervals = length(data.states[s]);
+        for (unsigned i = 0; i < nIntervals; ++i)
+            appendPosteriorRaw(out, (__uint32)data.setPos[s][i]);
+        for (unsigned i = 0; i < nIntervals; ++i)
+            appendPosteriorRaw(out, (__uint32)length(data.states[s][i]));
+        padPosteriorBlock(out);
+
+        for (unsigned k = 0; k < 4; ++k)
+            for (unsigned i = 0; i < nIntervals; ++i)
+                for (unsigned t = 0; t < length(data.states[s][i]); ++t)
+                    appendPosteriorRaw(out, (double)data.statePosteriors[s][k][i][t]);
+        for (unsigned i = 0; i < nIntervals; ++i)
+            for (unsigned t = 0; t < length(data.states[s][i]); ++t)
+                appendPosteriorRaw(out, getStateScore(data, s, i, t));
+        for (unsigned i = 0; i < nIntervals; ++i)
+            for (unsigned t = 0; t < length(data.states[s][i]); ++t)
+                appendPosteriorRaw(out, getEnrichmentScore(data, s, i, t));
+        for (unsigned i = 0; i < nIntervals; ++i)
+            for (unsigned t = 0; t < length(data.states[s][i]); ++t)
+                appendPosteriorRaw(out, (double)data.setObs[s][i].kdes[t]);
+        for (unsigned i = 0; i < nIntervals; ++i)
+            for (unsigned t = 0; t < length(data.states[s][i]); ++t)
+                appendPosteriorRaw(out, (options.useCov_RPKM) ? (double)data.setObs[s][i].rpkms[t] : 0.0);
+        for (unsigned i = 0; i < nIntervals; ++i)
+            for (unsigned t = 0; t < length(data.states[s][i]); ++t)
+                appendPosteriorRaw(out, (__uint16)data.setObs[s][i].nEstimates[t]);
+        for (unsigned i = 0; i < nIntervals; ++i)
+            out.append(reinterpret_cast<char const *>(begin(data.states[s][i], Standard())), length(data.states[s][i]));
+        for (unsigned i = 0; i < nIntervals; ++i)
+            out.append(reinterpret_cast<char const *>(begin(data.setObs[s][i].truncCounts, Standard())), length(data.states[s][i]));
+        padPosteriorBlock(out);
+    }
+}
+
+// index and footer, offsets of all blocks written
+inline std::string getPosteriorFileFooter(std::vector<__uint64> const &blockOffsets, __uint64 indexOffset)
+{
+    std::string footer;
+    for (size_t k = 0; k < blockOffsets.size(); ++k)
+        appendPosteriorRaw(footer, blockOffsets[k]);
+    appendPosteriorRaw(footer, indexOffset);
+    appendPosteriorRaw(footer, (__uint32)blockOffsets.size());
+    appendPosteriorRaw(footer, POSTERIOR_FILE_VERSION);
+    footer.append(POSTERIOR_FILE_MAGIC, 8);
+    return footer;
+}
+
+
+// memory-mapped posterior file
+struct PosteriorFile
+{
+    char const *            data;
+    size_t                  fileSize;
+    __uint32                flags;
+    std::vector<__uint64>   blockOffsets;
+
+    PosteriorFile() : data(NULL), fileSize(0), flags(0) {}
+    ~PosteriorFile()
+    {
+        if (data != NULL)
+            munmap(const_cast<char *>(data), fileSize);
+    }
+
+private:
+    PosteriorFile(PosteriorFile const &);
+    PosteriorFile & operator=(PosteriorFile const &);
+};
+
+inline bool openPosteriorFile(PosteriorFile &file, CharString const &fileName)
+{
+    int fd = ::open(toCString(fileName), O_RDONLY);
+    if (fd == -1)
+    {
+        std::cerr << "ERROR: Could not open " << fileName << " for reading.\n";
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 16 + 24)
+    {
+        ::close(fd);
+        std::cerr << "ERROR: " << fileName << " is not a valid posterior file.\n";
+        return false;
+    }
+    file.fileSize = st.st_size;
+    void * mapped = mmap(NULL, file.fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED)
+    {
+        std::cerr << "ERROR: Could not read " << fileName << ".\n";
+        return false;
+    }
+    file.data = static_cast<char const *>(mapped);
+
+    __uint32 version;
+    __uint64 indexOffset;
+    __uint32 nBlocks;
+    char const * footer = file.data + file.fileSize - 24;
+    std::memcpy(&version, file.data + 8, 4);
+    std::memcpy(&file.flags, file.data + 12, 4);
+    std::memcpy(&indexOffset, footer, 8);
+    std::memcpy(&nBlocks, footer + 8, 4);
+    if (std::memcmp(file.data, POSTERIOR_FILE_MAGIC, 8) != 0 || std::memcmp(footer + 16, POSTERIOR_FILE_MAGIC, 8) != 0 ||
+        version != POSTERIOR_FILE_VERSION || indexOffset + 8 * (__uint64)nBlocks != file.fileSize - 24)
+    {
+        std::cerr << "ERROR: " << fileName << " is not a valid posterior file or was not completely written.\n";
+        return false;
+    }
+    file.blockOffsets.resize(nBlocks);
+    if (nBlocks > 0)
+        std::memcpy(&file.blockOffsets[0], file.data + indexOffset, 8 * (size_t)nBlocks);
+    for (unsigned k = 0; k < nBlocks; ++k)
+    {
+        if (file.blockOffsets[k] + 8 > indexOffset)
+        {
+            std::cerr << "ERROR: " << fileName << " is not a valid posterior file.\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+inline size_t alignPosteriorOffset(size_t p)
+{
+    return (p + 7) & ~(size_t)7;
+}
+
+// contig name and length of block k
+inline void getPosteriorBlockContig(CharString &contigName, unsigned &contigLength, PosteriorFile const &file, unsigned k)
+{
+    size_t p = file.blockOffsets[k];
+    __uint32 nameLength;
+    std::memcpy(&nameLength, file.data + p, 4);
+    contigName = CharString(std::string(file.data + p + 4, nameLength));
+    p = alignPosteriorOffset(p + 4 + nameLength);
+    __uint32 len;
+    std::memcpy(&len, file.data + p, 4);
+    contigLength = len;
+}
+
+template <typename TValue>
+inline TValue readPosteriorValue(char const * column, __uint64 j)
+{
+    TValue value;
+    std::memcpy(&value, column + j * sizeof(TValue), sizeof(TValue));
+    return value;
+}
+
+// fill data with covered intervals of block (as after applyHMM), scores as stored
+// block: 8-byte aligned in file, offsets relative to block start
+inline bool loadPosteriorBlock(Data &data, char const * block, size_t blockSize, unsigned contigId)
+{
+    if (blockSize < 4)
+        return false;
+    __uint32 nameLength;
+    std::memcpy(&nameLength, block, 4);
+    size_t p = alignPosteriorOffset(4 + (size_t)nameLength) + 8;
+    if (p + 32 > blockSize)
+        return false;
+
+    __uint32 nIntervals[2];
+    __uint64 nPositions[2];
+    for (unsigned s = 0; s < 2; ++s)
+    {
+        std::memcpy(&nIntervals[s], block + p + 16 * s, 4);
+        std::memcpy(&nPositions[s], block + p + 16 * s + 8, 8);
+    }
+    p += 32;
+
+    resize(data.setObs, 2);
+    resize(data.setPos, 2);
+    resize(data.statePosteriors, 2);
+    resize(data.states, 2);
+    resize(data.stateScores, 2);
+    for (unsigned s = 0; s < 2; ++s)
+    {
+        size_t intervalsEnd = alignPosteriorOffset(p + 8 * (size_t)nIntervals[s]);
+        size_t blockEnd = alignPosteriorOffset(intervalsEnd + POSTERIOR_FILE_BYTES_PER_POS * (size_t)nPositions[s]);
+        if (blockEnd > blockSize)
+            return false;
+
+        char const * setPos = block + p;
+        char const * lengths = setPos + 4 * (size_t)nIntervals[s];
+        char const * posteriors = block + intervalsEnd;
+        char const * scores = posteriors + 32 * (size_t)nPositions[s];
+        char const * enrichmentScores = scores + 8 * (size_t)nPositions[s];
+        char const * kdes = enrichmentScores + 8 * (size_t)nPositions[s];
+        char const * rpkms = kdes + 8 * (size_t)nPositions[s];
+        char const * nEstimates = rpkms + 8 * (size_t)nPositions[s];
+        char const * states = nEstimates + 2 * (size_t)nPositions[s];
+        char const * truncCounts = states + nPositions[s];
+
+        resize(data.setObs[s], nIntervals[s]);
+        resize(data.setPos[s], nIntervals[s]);
+        resize(data.states[s], nIntervals[s]);
+        resize(data.stateScores[s], nIntervals[s]);
+        resize(data.statePosteriors[s], 4);
+        for (unsigned st = 0; st < 4; ++st)
+            resize(data.statePosteriors[s][st], nIntervals[s]);
+        __uint64 j = 0;
+        for (unsigned i = 0; i < nIntervals[s]; ++i)
+        {
+            unsigned len = readPosteriorValue<__uint32>(lengths, i);
+            if (j + len > nPositions[s])
+                return false;
+            data.setPos[s][i] = readPosteriorValue<__uint32>(setPos, i);
+            Observations &obs = data.setObs[s][i];
+            obs.contigId = contigId;
+            resize(obs.truncCounts, len, Exact());
+            resize(obs.nEstimates, len, Exact());
+            resize(obs.kdes, len, Exact());
+            resize(obs.rpkms, len, Exact());
+            resize(data.states[s][i], len, Exact());
+            resize(data.stateScores[s][i], len, Exact());
+            for (unsigned st = 0; st < 4; ++st)
+                resize(data.statePosteriors[s][st][i], len, Exact());
+            std::memcpy(begin(obs.truncCounts, Standard()), truncCounts + j, len);
+            std::memcpy(begin(data.states[s][i], Standard()), states + j, len);
+            for (unsigned t = 0; t < len; ++t, ++j)
+            {
+                for (unsigned st = 0; st < 4; ++st)
+                    data.statePosteriors[s][st][i][t] = readPosteriorValue<double>(posteriors + 8 * st * (size_t)nPositions[s], j);
+                data.stateScores[s][i][t] = readPosteriorValue<double>(scores, j);
+                obs.kdes[t] = readPosteriorValue<double>(kdes, j);
+                obs.rpkms[t] = readPosteriorValue<double>(rpkms, j);
+                obs.nEstimates[t] = readPosteriorValue<__uint16>(nEstimates, j);
+            }
+        }
+        p = blockEnd;
+    }
+    return true;
+}
+
+// fill data with covered intervals of block k
+inline bool loadPosteriorBlock(Data &data, PosteriorFile const &file, unsigned k, unsigned contigId)
+{
+    size_t end = (k + 1 < file.blockOffsets.size()) ? file.blockOffsets[k + 1] : file.fileSize - 24 - 8 * file.blockOffsets.size();
+    if (file.blockOffsets[k] > end)
+        return false;
+    return loadPosteriorBlock(data, file.data + file.blockOffsets[k], end - file.blockOffsets[k], contigId);
+}
+
+#endif
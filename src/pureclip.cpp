@@ -44,6 +44,57 @@
 using namespace seqan;
 
  
+// BGZF output is chosen by extension .bed.gz, -o and -or have to agree, -bgz requires it
+bool getBgzfOutput(AppOptions &options, bool bgzSet)
+{
+    bool gz = length(options.outFileName) >= 3 && suffix(options.outFileName, length(options.outFileName) - 3) == ".gz";
+    bool gzRegions = length(options.outRegionsFileName) >= 3 && suffix(options.outRegionsFileName, length(options.outRegionsFileName) - 3) == ".gz";
+    if (!empty(options.outRegionsFileName) && gz != gzRegions)
+    {
+        std::cerr << "ERROR: Either both or none of -o and -or have to end with .bed.gz (BGZF-compressed output)." << std::endl;
+        return false;
+    }
+    if (bgzSet && !gz)
+    {
+        std::cerr << "ERROR: With -bgz output files have to end with .bed.gz." << std::endl;
+        return false;
+    }
+    options.bgzfOutput = gz;
+    return true;
+}
+
+// KDE engine (-ke) and kernel (-kt), shared by main run and ctrlkde
+void addKdeOptions(ArgumentParser &parser)
+{
+    addOption(parser, ArgParseOption("ke", "ke", "Engine to compute KDEs: kernel added around positions with read starts (sparse), direct summation over +-4*bandwidth (reference) or FFT convolution, with runtime independent of bandwidth. Default: sparse.", ArgParseArgument::STRING));
+    setValidValues(parser, "ke", "sparse direct fft");
+    addOption(parser, ArgParseOption("kt", "kt", "Kernel for density estimation. Kernels with compact support [-bandwidth, bandwidth] (epanechnikov, triangular, box) are computed with running sums, with runtime independent of bandwidth (except for -ke direct). Default: gaussian.", ArgParseArgument::STRING));
+    setValidValues(parser, "kt", "gaussian epanechnikov triangular box");
+}
+
+void getKdeOptions(AppOptions &options, ArgumentParser const &parser)
+{
+    if (isSet(parser, "ke"))
+    {
+        CharString kdeEngine;
+        getOptionValue(kdeEngine, parser, "ke");
+        if (kdeEngine == "direct")
+            options.kdeEngine = KDE_DIRECT;
+        else if (kdeEngine == "fft")
+            options.kdeEngine = KDE_FFT;
+        else
+            options.kdeEngine = KDE_SPARSE;
+    }
+    if (isSet(parser, "kt"))
+    {
+        CharString kernel;
+        getOptionValue(kernel, parser, "kt");
+        options.gaussianKernel = (kernel == "gaussian");
+        options.epanechnikovKernel = (kernel == "epanechnikov");
+        options.triangularKernel = (kernel == "triangular");
+        options.boxKernel = (kernel == "box");
+    }
+}
 
 ArgumentParser::ParseResult
 parseCommandLine(AppOptions & options, int argc, char const ** argv)
@@ -73,10 +124,10 @@ parseCommandLine(AppOptions & options, int argc, char const ** argv)
     setRequired(parser, "genome", true);  
 
     addOption(parser, ArgParseOption("o", "out", "Output file to write crosslink sites.", ArgParseArgument::OUTPUT_FILE));
-    setValidValues(parser, "out", ".bed");
+    setValidValues(parser, "out", ".bed .bed.gz");
     setRequired(parser, "out", true);
     addOption(parser, ArgParseOption("or", "or", "Output file to write binding regions.", ArgParseArgument::OUTPUT_FILE));
-    setValidValues(parser, "or", ".bed");
+    setValidValues(parser, "or", ".bed .bed.gz");
     addOption(parser, ArgParseOption("p", "par", "Output file to write learned parameters.", ArgParseArgument::OUTPUT_FILE));
     //setRequired(parser, "par", true);
     
@@ -89,21 +140,24 @@ parseCommandLine(AppOptions & options, int argc, char const ** argv)
     addOption(parser, ArgParseOption("bw", "bdw", "Bandwidth for kernel density estimation. NOTE: Increasing the bandwidth increases runtime and memory consumption. Default: 50.", ArgParseArgument::INTEGER));
     setMinValue(parser, "bdw", "1");
     setMaxValue(parser, "bdw", "500"); 
+    addKdeOptions(parser);
 
     addOption(parser, ArgParseOption("dm", "dm", "Distance used to merge individual crosslink sites to binding regions. Default: 8", ArgParseArgument::INTEGER));
+    addOption(parser, ArgParseOption("mss", "mss", "Min. score (log posterior probability ratio) of crosslink sites, also applied before merging sites to binding regions. Default: 0 (all sites in crosslink state).", ArgParseArgument::DOUBLE));
 
 
     addSection(parser, "Options for incorporating covariates");
 
-    addOption(parser, ArgParseOption("is", "is", "Covariates file: position-wise values, e.g. smoothed reads start counts (KDEs) from input data. ", ArgParseArgument::INPUT_FILE));
-    setValidValues(parser, "is", ".bed");
+    addOption(parser, ArgParseOption("is", "is", "Covariates file: position-wise values, e.g. smoothed reads start counts (KDEs) from input data. BED or binary track created with 'pureclip covtrack' or 'pureclip ctrlkde'. ", ArgParseArgument::INPUT_FILE));
+    setValidValues(parser, "is", ".bed .pcov");
     addOption(parser, ArgParseOption("ibam", "ibam", "File containing mapped reads from control experiment, e.g. eCLIP input.", ArgParseArgument::INPUT_FILE));
     setValidValues(parser, "ibam", ".bam");
     addOption(parser, ArgParseOption("ibai", "ibai", "File containing BAM index corresponding to mapped reads from control experiment", ArgParseArgument::INPUT_FILE));
     setValidValues(parser, "ibai", ".bai");
+    addOption(parser, ArgParseOption("ibs", "ibs", "Parse control BAM file in one sorted sweep per contig, distributing read starts to all covered intervals, instead of jumping to each interval separately."));
 
-    addOption(parser, ArgParseOption("fis", "fis", "Fimo input motif score covariates file.", ArgParseArgument::INPUT_FILE));
-    setValidValues(parser, "fis", ".bed");
+    addOption(parser, ArgParseOption("fis", "fis", "Fimo input motif score covariates file. BED or binary track created with 'pureclip covtrack -m'.", ArgParseArgument::INPUT_FILE));
+    setValidValues(parser, "fis", ".bed .pcov");
     addOption(parser, ArgParseOption("nim", "nim", "Max. motif ID to use. Default: Only covariates with motif ID 1 are used.", ArgParseArgument::INTEGER));
 
 
@@ -140,6 +194,8 @@ parseCommandLine(AppOptions & options, int argc, char const ** argv)
     addOption(parser, ArgParseOption("et2", "epta", "Exclude intervals containing poly-U stretches from analysis."));
  
     addOption(parser, ArgParseOption("mrtf", "mrtf", "Fit gamma shape k only for positions with min. covariate value.", ArgParseArgument::DOUBLE));
+    addOption(parser, ArgParseOption("bl", "bl", "Blacklist BED file of regions to mask, e.g. rRNA, snRNA or mitochondrial genes. Read starts within are discarded right after parsing.", ArgParseArgument::INPUT_FILE));
+    setValidValues(parser, "bl", ".bed");
     addOption(parser, ArgParseOption("mtc", "mtc", "Maximum number of truncations at one position. For sites with counts above threshold the whole interval will be discarded! Default: 250.", ArgParseArgument::INTEGER));
     setMinValue(parser, "mtc", "50");
     setMaxValue(parser, "mtc", "254"); 
@@ -151,8 +207,19 @@ parseCommandLine(AppOptions & options, int argc, char const ** argv)
     addSection(parser, "General user options");
     addOption(parser, ArgParseOption("nt", "nt", "Number of threads used for learning.", ArgParseArgument::INTEGER));
     addOption(parser, ArgParseOption("nta", "nta", "Number of threads used for applying learned parameters. Increases memory usage, if greater than number of chromosomes used for learning, since HMM will be build for multiple chromosomes in parallel.", ArgParseArgument::INTEGER));
+    addOption(parser, ArgParseOption("ntb", "ntb", "Number of threads used to decompress the target BAM file ahead of parsing (per parsed contig). Default: 1 (decompression within parsing thread).", ArgParseArgument::INTEGER));
+    setMinValue(parser, "ntb", "1");
+    addOption(parser, ArgParseOption("ntc", "ntc", "Number of threads used to parse the target BAM file in parallel, splitting contigs into chunks along the BAI linear index. Most effective with -sp, since contigs are otherwise already parsed in parallel. Default: 1.", ArgParseArgument::INTEGER));
+    setMinValue(parser, "ntc", "1");
+    addOption(parser, ArgParseOption("sp", "sp", "Parse target BAM file in a single sequential pass for all contigs, instead of once per contig for learning and again for applying. Increases memory usage, since read start counts of all contigs are kept."));
+    addOption(parser, ArgParseOption("cc", "cc", "Cache read start counts of target BAM file in binary file (within -tmp directory if given, otherwise next to output file) and reuse them in subsequent runs on the same BAM file. Implies -sp."));
     addOption(parser, ArgParseOption("tmp", "tmp", "Path to directory to store intermediate files. Default: /tmp ?", ArgParseArgument::STRING));
     addOption(parser, ArgParseOption("oa", "oa", "Outputs all sites with at least one read start in extended output format."));
+    addOption(parser, ArgParseOption("opb", "opb", "Output file to write per-position state posteriors, site scores, KDEs, covariates and states of all covered intervals in binary format (memory-mappable).", ArgParseArgument::OUTPUT_FILE));
+    setValidValues(parser, "opb", ".ppost");
+    addOption(parser, ArgParseOption("bgz", "bgz", "Write crosslink sites and binding regions BGZF-compressed (as bgzip) and create tabix indices (<output>.tbi) in the same pass. Implied by output files ending with .bed.gz."));
+    addOption(parser, ArgParseOption("ntz", "ntz", "Number of threads used to compress output with -bgz. Default: 1.", ArgParseArgument::INTEGER));
+    setMinValue(parser, "ntz", "1");
 
     addOption(parser, ArgParseOption("q", "quiet", "Set verbosity to a minimum."));
     addOption(parser, ArgParseOption("v", "verbose", "Enable verbose output."));
@@ -185,10 +252,13 @@ parseCommandLine(AppOptions & options, int argc, char const ** argv)
     getOptionValue(options.refFileName, parser, "genome");
     getOptionValue(options.outFileName, parser, "out");
     getOptionValue(options.outRegionsFileName, parser, "or");
+    getOptionValue(options.outPosteriorsFileName, parser, "opb");
     getOptionValue(options.parFileName, parser, "par");
     getOptionValue(options.rpkmFileName, parser, "is");
     getOptionValue(options.inputBamFileName, parser, "ibam");
     getOptionValue(options.inputBaiFileName, parser, "ibai");
+    if (isSet(parser, "ibs"))
+        options.sweepInputBam = true;
     if ((options.rpkmFileName != "" && options.inputBamFileName != "") || 
             (options.rpkmFileName != "" && options.inputBaiFileName != "") || 
             (options.inputBamFileName != "" && options.inputBaiFileName == "") ||
@@ -215,6 +285,7 @@ parseCommandLine(AppOptions & options, int argc, char const ** argv)
     //if (isSet(parser, "g1g2k"))
     //    options.g1_k_le_g2_k = true;
     getOptionValue(options.bandwidth, parser, "bdw");
+    getKdeOptions(options, parser);
 
     getOptionValue(options.useKdeThreshold, parser, "mkde");
 
@@ -222,6 +293,7 @@ parseCommandLine(AppOptions & options, int argc, char const ** argv)
     getOptionValue(options.minTransProbCS, parser, "mtp");
     getOptionValue(options.maxkNratio, parser, "mkn");
     getOptionValue(options.distMerge, parser, "dm");
+    getOptionValue(options.minSiteScore, parser, "mss");
 
     getOptionValue(options.polyAThreshold, parser, "pat");
     if (isSet(parser, "epal"))
@@ -238,6 +310,7 @@ parseCommandLine(AppOptions & options, int argc, char const ** argv)
         options.mrtf_kdeSglt = false;
 
     getOptionValue(options.maxTruncCount, parser, "mtc");
+    getOptionValue(options.blacklistFileName, parser, "bl");
  
     getOptionValue(options.nInputMotifs, parser, "nim");
 
@@ -245,9 +318,21 @@ parseCommandLine(AppOptions & options, int argc, char const ** argv)
 
     getOptionValue(options.numThreads, parser, "nt");
     getOptionValue(options.numThreadsA, parser, "nta");
+    getOptionValue(options.numThreadsBgzf, parser, "ntb");
+    getOptionValue(options.numThreadsBamChunks, parser, "ntc");
+    if (isSet(parser, "sp"))
+        options.singlePassBam = true;
+    if (isSet(parser, "cc"))
+    {
+        options.useCountCache = true;
+        options.singlePassBam = true;
+    }
     getOptionValue(options.tempPath, parser, "tmp");
     if (isSet(parser, "oa"))
         options.outputAll = true;
+    if (!getBgzfOutput(options, isSet(parser, "bgz")))
+        return ArgumentParser::PARSE_ERROR;
+    getOptionValue(options.numThreadsBgzfOut, parser, "ntz");
  
     // Extract option values.
     if (isSet(parser, "quiet"))
@@ -274,8 +359,188 @@ parseCommandLine(AppOptions & options, int argc, char const ** argv)
 
 
 
+// pureclip covtrack: convert covariates BED file into binary random-access track (.pcov)
+int covTrackMain(int argc, char const ** argv)
+{
+    ArgumentParser parser("pureclip covtrack");
+    setShortDescription(parser, "Convert covariates BED file into binary track");
+    setVersion(parser, "1.0.0");
+    setDate(parser, "Juni 2017");
+    addUsageLine(parser, "[\\fIOPTIONS\\fP] <-i \\fIBED FILE\\fP> <-g \\fIGENOME FILE\\fP> <-o \\fITRACK FILE\\fP> ");
+    addDescription(parser, "Rasterizes position-wise covariates (-is) or fimo motif scores (-fis, with -m) once, so that PureCLIP can load them per contig without parsing the BED file.");
+
+    addOption(parser, ArgParseOption("i", "in", "Covariates BED file.", ArgParseArgument::INPUT_FILE));
+    setValidValues(parser, "in", ".bed");
+    setRequired(parser, "in", true);
+    addOption(parser, ArgParseOption("g", "genome", "Genome reference file.", ArgParseArgument::INPUT_FILE));
+    setValidValues(parser, "genome", ".fa .fasta");
+    setRequired(parser, "genome", true);
+    addOption(parser, ArgParseOption("o", "out", "Output track file.", ArgParseArgument::OUTPUT_FILE));
+    setValidValues(parser, "out", ".pcov");
+    setRequired(parser, "out", true);
+    addOption(parser, ArgParseOption("m", "motifs", "Input is a fimo motif score file (as used for -fis)."));
+    addOption(parser, ArgParseOption("nim", "nim", "Max. motif ID to store. Default: 255.", ArgParseArgument::INTEGER));
+    setMinValue(parser, "nim", "1");
+    setMaxValue(parser, "nim", "255");
+    addOption(parser, ArgParseOption("q", "quiet", "Set verbosity to a minimum."));
+
+    ArgumentParser::ParseResult res = parse(parser, argc, argv);
+    if (res != ArgumentParser::PARSE_OK)
+        return res == ArgumentParser::PARSE_ERROR;
+
+    AppOptions options;
+    CharString inFileName;
+    CharString outFileName;
+    unsigned maxMotifId = 255;
+    getOptionValue(inFileName, parser, "in");
+    getOptionValue(options.refFileName, parser, "genome");
+    getOptionValue(outFileName, parser, "out");
+    getOptionValue(maxMotifId, parser, "nim");
+    if (isSet(parser, "quiet"))
+        options.verbosity = 0;
+
+    ReferenceStore store;
+    if (!loadReference(store, options.refFileName, options))
+        return 1;
+    CovariateIndex covIndex;
+    if (options.verbosity >= 1) std::cout << "Parse covariates " << inFileName << std::endl;
+    if (!loadCovariateIndex(covIndex, inFileName, store, options))
+        return 1;
+    if (!writeCovariateTrack(outFileName, covIndex, store, isSet(parser, "motifs"), maxMotifId))
+        return 1;
+    if (options.verbosity >= 1) std::cout << "Wrote covariate track " << outFileName << std::endl;
+    return 0;
+}
+
+
+// pureclip ctrlkde: compute KDEs of control BAM file once for all contigs and write them into binary track (.pcov)
+int ctrlKdeMain(int argc, char const ** argv)
+{
+    ArgumentParser parser("pureclip ctrlkde");
+    setShortDescription(parser, "Precompute control KDE track");
+    setVersion(parser, "1.0.0");
+    setDate(parser, "Juni 2017");
+    addUsageLine(parser, "[\\fIOPTIONS\\fP] <-i \\fICONTROL BAM FILE\\fP> <-bai \\fIBAI FILE\\fP> <-g \\fIGENOME FILE\\fP> <-o \\fITRACK FILE\\fP> ");
+    addDescription(parser, "Computes the input signal (KDEs of read start counts) of a control experiment, e.g. eCLIP input, genome-wide at the given bandwidth. The track can be passed to PureCLIP via -is instead of -ibam/-ibai and reused for all target experiments analysed with the same bandwidth.");
+
+    addOption(parser, ArgParseOption("i", "in", "File containing mapped reads from control experiment.", ArgParseArgument::INPUT_FILE));
+    setValidValues(parser, "in", ".bam");
+    setRequired(parser, "in", true);
+    addOption(parser, ArgParseOption("bai", "bai", "File containing BAM index corresponding to mapped reads from control experiment.", ArgParseArgument::INPUT_FILE));
+    setValidValues(parser, "bai", ".bai");
+    setRequired(parser, "bai", true);
+    addOption(parser, ArgParseOption("g", "genome", "Genome reference file.", ArgParseArgument::INPUT_FILE));
+    setValidValues(parser, "genome", ".fa .fasta");
+    setRequired(parser, "genome", true);
+    addOption(parser, ArgParseOption("o", "out", "Output track file.", ArgParseArgument::OUTPUT_FILE));
+    setValidValues(parser, "out", ".pcov");
+    setRequired(parser, "out", true);
+    addOption(parser, ArgParseOption("bw", "bdw", "Bandwidth for kernel density estimation, has to match bandwidth used by PureCLIP. Default: 50.", ArgParseArgument::INTEGER));
+    setMinValue(parser, "bdw", "1");
+    setMaxValue(parser, "bdw", "500"); 
+    addKdeOptions(parser);
+    addOption(parser, ArgParseOption("ntb", "ntb", "Number of threads used to decompress the BAM file ahead of parsing. Default: 1.", ArgParseArgument::INTEGER));
+    setMinValue(parser, "ntb", "1");
+    addOption(parser, ArgParseOption("ntc", "ntc", "Number of threads used to parse chunks of a contig in parallel. Default: 1.", ArgParseArgument::INTEGER));
+    setMinValue(parser, "ntc", "1");
+    addOption(parser, ArgParseOption("q", "quiet", "Set verbosity to a minimum."));
+    addOption(parser, ArgParseOption("v", "verbose", "Enable verbose output."));
+
+    ArgumentParser::ParseResult res = parse(parser, argc, argv);
+    if (res != ArgumentParser::PARSE_OK)
+        return res == ArgumentParser::PARSE_ERROR;
+
+    AppOptions options;
+    CharString outFileName;
+    getOptionValue(options.bamFileName, parser, "in");
+    getOptionValue(options.baiFileName, parser, "bai");
+    getOptionValue(options.refFileName, parser, "genome");
+    getOptionValue(outFileName, parser, "out");
+    getOptionValue(options.bandwidth, parser, "bdw");
+    getKdeOptions(options, parser);
+    getOptionValue(options.numThreadsBgzf, parser, "ntb");
+    getOptionValue(options.numThreadsBamChunks, parser, "ntc");
+    if (isSet(parser, "quiet"))
+        options.verbosity = 0;
+    if (isSet(parser, "verbose"))
+        options.verbosity = 2;
+#if HMM_PARALLEL
+    omp_set_num_threads(options.numThreadsBamChunks);
+#endif
+
+    ReferenceStore store;
+    if (!loadReference(store, options.refFileName, options))
+        return 1;
+    if (!writeControlKdeTrack(outFileName, store, options))
+        return 1;
+    if (options.verbosity >= 1) std::cout << "Wrote control KDE track " << outFileName << " (bandwidth " << options.bandwidth << ")" << std::endl;
+    return 0;
+}
+
+
+// pureclip recall: call crosslink sites and binding regions again from binary posterior file (-opb)
+int recallMain(int argc, char const ** argv)
+{
+    ArgumentParser parser("pureclip recall");
+    setShortDescription(parser, "Recall crosslink sites from saved posteriors");
+    setVersion(parser, "1.0.0");
+    setDate(parser, "Juni 2017");
+    addUsageLine(parser, "[\\fIOPTIONS\\fP] <-i \\fIPOSTERIOR FILE\\fP> <-o \\fIOUTPUT BED FILE\\fP> ");
+    addDescription(parser, "Writes crosslink sites and binding regions from the state posteriors saved with -opb, using new score cut-off and merge distance. Alignments are not parsed and the HMM is not applied again.");
+
+    addOption(parser, ArgParseOption("i", "in", "Posterior file written with -opb.", ArgParseArgument::INPUT_FILE));
+    setValidValues(parser, "in", ".ppost");
+    setRequired(parser, "in", true);
+    addOption(parser, ArgParseOption("o", "out", "Output file to write crosslink sites.", ArgParseArgument::OUTPUT_FILE));
+    setValidValues(parser, "out", ".bed .bed.gz");
+    setRequired(parser, "out", true);
+    addOption(parser, ArgParseOption("or", "or", "Output file to write binding regions.", ArgParseArgument::OUTPUT_FILE));
+    setValidValues(parser, "or", ".bed .bed.gz");
+    addOption(parser, ArgParseOption("dm", "dm", "Distance used to merge individual crosslink sites to binding regions. Default: 8", ArgParseArgument::INTEGER));
+    addOption(parser, ArgParseOption("mss", "mss", "Min. score (log posterior probability ratio) of crosslink sites. Default: 0 (all sites in crosslink state).", ArgParseArgument::DOUBLE));
+    addOption(parser, ArgParseOption("oa", "oa", "Outputs all sites with at least one read start in extended output format."));
+    addOption(parser, ArgParseOption("bgz", "bgz", "Write output BGZF-compressed and create tabix indices. Implied by output files ending with .bed.gz."));
+    addOption(parser, ArgParseOption("ntz", "ntz", "Number of threads used to compress output with -bgz. Default: 1.", ArgParseArgument::INTEGER));
+    setMinValue(parser, "ntz", "1");
+    addOption(parser, ArgParseOption("nt", "nt", "Number of threads used to format output of contigs in parallel. Default: 1.", ArgParseArgument::INTEGER));
+    setMinValue(parser, "nt", "1");
+    addOption(parser, ArgParseOption("q", "quiet", "Set verbosity to a minimum."));
+
+    ArgumentParser::ParseResult res = parse(parser, argc, argv);
+    if (res != ArgumentParser::PARSE_OK)
+        return res == ArgumentParser::PARSE_ERROR;
+
+    AppOptions options;
+    CharString posteriorFileName;
+    getOptionValue(posteriorFileName, parser, "in");
+    getOptionValue(options.outFileName, parser, "out");
+    getOptionValue(options.outRegionsFileName, parser, "or");
+    getOptionValue(options.distMerge, parser, "dm");
+    getOptionValue(options.minSiteScore, parser, "mss");
+    if (isSet(parser, "oa"))
+        options.outputAll = true;
+    if (!getBgzfOutput(options, isSet(parser, "bgz")))
+        return 1;
+    getOptionValue(options.numThreadsBgzfOut, parser, "ntz");
+    getOptionValue(options.numThreadsA, parser, "nt");
+    if (isSet(parser, "quiet"))
+        options.verbosity = 0;
+
+    if (!recallSites(posteriorFileName, options))
+        return 1;
+    return 0;
+}
+
+
 int main(int argc, char const ** argv)
 {
+    if (argc > 1 && std::string(argv[1]) == "covtrack")
+        return covTrackMain(argc - 1, argv + 1);
+    if (argc > 1 && std::string(argv[1]) == "ctrlkde")
+        return ctrlKdeMain(argc - 1, argv + 1);
+    if (argc > 1 && std::string(argv[1]) == "recall")
+        return recallMain(argc - 1, argv + 1);
+
     // Parse the command line.
     ArgumentParser parser;
     AppOptions options;
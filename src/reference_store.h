@@ -0,0 +1,86 @@
+// ======================================================================
+// PureCLIP: capturing target-specific protein-RNA interaction footprints
+// ======================================================================
+// Copyright (C) 2017  Sabrina Krakau, Max Planck Institute for Molecular
+// Genetics
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// =======================================================================
+// Author: Sabrina Krakau <krakau@molgen.mpg.de>
+// =======================================================================
+
+#ifndef APPS_HMMS_REFERENCE_STORE_H_
+#define APPS_HMMS_REFERENCE_STORE_H_
+
+#include <iostream>
+#include <seqan/seq_io.h>
+
+using namespace seqan;
+
+
+// Reference contig names and lengths taken from FASTA index,
+// sequences are read on demand from the memory-mapped FASTA file
+struct ReferenceStore
+{
+    typedef StringSet<CharString>   TNameStore;
+
+    TNameStore          contigNameStore;
+    String<unsigned>    contigLengths;
+    FaiIndex            faiIndex;
+};
+
+// open FASTA index, build and save it if not existing
+inline bool loadReference(ReferenceStore &store, CharString const &refFileName, AppOptions &options)
+{
+    if (!open(store.faiIndex, toCString(refFileName)))
+    {
+        if (options.verbosity >= 1) std::cout << "Build FASTA index ... " << std::flush;
+        if (!build(store.faiIndex, toCString(refFileName)))
+        {
+            std::cerr << "ERROR: Could not build FASTA index for " << refFileName << ". Note: reference file has to be uncompressed.\n";
+            return false;
+        }
+        if (!save(store.faiIndex))
+            std::cout << "WARNING: Could not write FASTA index for " << refFileName << std::endl;
+    }
+
+    clear(store.contigNameStore);
+    clear(store.contigLengths);
+    for (unsigned contigId = 0; contigId < numSeqs(store.faiIndex); ++contigId)
+    {
+        CharString contigName = sequenceName(store.faiIndex, contigId);
+        cropAfterFirst(contigName, IsWhitespace());
+        appendValue(store.contigNameStore, contigName);
+        appendValue(store.contigLengths, sequenceLength(store.faiIndex, contigId));
+    }
+    return true;
+}
+
+inline unsigned getContigLength(ReferenceStore const &store, unsigned contigId)
+{
+    return store.contigLengths[contigId];
+}
+
+// sequence of [beginPos, endPos) of contig, positions are clipped to contig
+inline void readContigRegion(Dna5String &seq, ReferenceStore const &store, unsigned contigId, int beginPos, int endPos)
+{
+    beginPos = std::max(beginPos, 0);
+    endPos = std::min(endPos, (int)getContigLength(store, contigId));
+    clear(seq);
+    if (beginPos < endPos)
+        readRegion(seq, store.faiIndex, contigId, beginPos, endPos);
+}
+
+#endif
@@ -28,13 +28,27 @@
 #include <iostream>
 #include <fstream>
 #include <seqan/bed_io.h>
+#include <algorithm>
+#include <complex>
+#include <cfloat>
 
 #include <math.h>    
 
+#include "kde_simd.h"
+
 using namespace seqan;
 
 namespace seqan {
 
+    // computation of KDEs: scatter of kernel profile at positions with read starts, direct summation within 4*h
+    // or convolution via FFT, cost independent of h
+    enum KdeEngine
+    {
+        KDE_SPARSE,
+        KDE_DIRECT,
+        KDE_FFT
+    };
+
     struct AppOptions
     {
         CharString bamFileName;
@@ -42,11 +56,13 @@ namespace seqan {
         CharString refFileName;
         CharString outFileName;
         CharString outRegionsFileName;
+        CharString outPosteriorsFileName;
         CharString parFileName;
         CharString rpkmFileName;
         CharString inputBamFileName;
         CharString inputBaiFileName;
         CharString fimoFileName;
+        CharString blacklistFileName;
 
         CharString                  intervals_str;
         String<unsigned>            intervals_contigIds;
@@ -77,6 +93,9 @@ namespace seqan {
 
         bool gaussianKernel;
         bool epanechnikovKernel;
+        bool triangularKernel;
+        bool boxKernel;
+        KdeEngine kdeEngine;
         double useKdeThreshold;
 
         bool estimateNfromKdes;
@@ -103,9 +122,17 @@ namespace seqan {
         unsigned nInputMotifs;
 
         unsigned distMerge;
+        double minSiteScore;
 
         unsigned numThreads;
         unsigned numThreadsA;
+        bool singlePassBam;
+        bool useCountCache;
+        bool sweepInputBam;
+        unsigned numThreadsBgzf;
+        unsigned numThreadsBamChunks;
+        bool bgzfOutput;
+        unsigned numThreadsBgzfOut;
         CharString tempPath;
         bool outputAll;
         // Verbosity level.  0 -- quiet, 1 -- normal, 2 -- verbose, 3 -- very verbose.
@@ -133,6 +160,9 @@ namespace seqan {
             intervalOffset(50),             // offset for covered intervals to be stored in observations
             gaussianKernel(true),
             epanechnikovKernel(false),
+            triangularKernel(false),
+            boxKernel(false),
+            kdeEngine(KDE_SPARSE),
             useKdeThreshold(0.0),
             estimateNfromKdes(true),
             nThresholdForP(10),              // threshold regarding n used for fitting p, if GLM, this need to be larger! 
@@ -153,8 +183,16 @@ namespace seqan {
             useFimoScore(false),
             nInputMotifs(1),
             distMerge(8),
+            minSiteScore(0.0),                  // log posterior prob. ratio, 0: all sites in state 3
             numThreads(1),
             numThreadsA(1),
+            singlePassBam(false),
+            useCountCache(false),
+            sweepInputBam(false),
+            numThreadsBgzf(1),
+            numThreadsBamChunks(1),
+            bgzfOutput(false),
+            numThreadsBgzfOut(1),
             outputAll(false),
             verbosity(1)
         {}
@@ -187,20 +225,211 @@ namespace seqan {
 
 
 
+    // read start counts of one contig and strand, stored sparse
     struct ContigObservations {
-        String<__uint8> truncCounts; 
+        unsigned            contigLength;
+        String<unsigned>    positions;      // sorted positions with at least one read start
+        String<__uint8>     counts;         // corresponding read start counts, capped at 254
+        String<unsigned>    pending;        // read starts added out of order, merged by finalize()
+
+        ContigObservations() : contigLength(0) {}
     };
 
+    inline void init(ContigObservations &contigObservations, unsigned contigLength)
+    {
+        contigObservations.contigLength = contigLength;
+        clear(contigObservations.positions);
+        clear(contigObservations.counts);
+        clear(contigObservations.pending);
+    }
+
+    inline bool empty(ContigObservations const &contigObservations)
+    {
+        return contigObservations.contigLength == 0;
+    }
+
+    // merge pending read starts into sorted positions and counts
+    inline void finalize(ContigObservations &contigObservations)
+    {
+        String<unsigned> &pending = contigObservations.pending;
+        if (empty(pending))
+            return;
+        std::sort(begin(pending, Standard()), end(pending, Standard()));
+
+        String<unsigned> positions;
+        String<__uint8> counts;
+        reserve(positions, length(contigObservations.positions) + length(pending), Exact());
+        reserve(counts, length(contigObservations.positions) + length(pending), Exact());
+        unsigned k = 0;
+        unsigned j = 0;
+        while (k < length(contigObservations.positions) || j < length(pending))
+        {
+            unsigned pos;
+            unsigned count = 0;
+            if (j >= length(pending) || (k < length(contigObservations.positions) && contigObservations.positions[k] <= pending[j]))
+                pos = contigObservations.positions[k];
+            else
+                pos = pending[j];
+            if (k < length(contigObservations.positions) && contigObservations.positions[k] == pos)
+                count += contigObservations.counts[k++];
+            while (j < length(pending) && pending[j] == pos)
+            {
+                ++count;
+                ++j;
+            }
+            appendValue(positions, pos);
+            appendValue(counts, (__uint8)std::min(count, (unsigned)254));
+        }
+        swap(contigObservations.positions, positions);
+        swap(contigObservations.counts, counts);
+        clear(pending);
+        shrinkToFit(pending);
+    }
+
+    // add read start counts of other part of same contig and strand, both finalized
+    inline void addCounts(ContigObservations &contigObservations, ContigObservations const &other)
+    {
+        if (empty(other.positions))
+            return;
+        if (empty(contigObservations.positions) || back(contigObservations.positions) < front(other.positions))
+        {
+            append(contigObservations.positions, other.positions);
+            append(contigObservations.counts, other.counts);
+            return;
+        }
+
+        String<unsigned> positions;
+        String<__uint8> counts;
+        reserve(positions, length(contigObservations.positions) + length(other.positions), Exact());
+        reserve(counts, length(contigObservations.positions) + length(other.positions), Exact());
+        unsigned k = 0;
+        unsigned j = 0;
+        while (k < length(contigObservations.positions) || j < length(other.positions))
+        {
+            if (j >= length(other.positions) || (k < length(contigObservations.positions) && contigObservations.positions[k] < other.positions[j]))
+            {
+                appendValue(positions, contigObservations.positions[k]);
+                appendValue(counts, contigObservations.counts[k++]);
+            }
+            else if (k >= length(contigObservations.positions) || other.positions[j] < contigObservations.positions[k])
+            {
+                appendValue(positions, other.positions[j]);
+                appendValue(counts, other.counts[j++]);
+            }
+            else
+            {
+                appendValue(positions, other.positions[j]);
+                appendValue(counts, (__uint8)std::min((unsigned)contigObservations.counts[k++] + (unsigned)other.counts[j++], (unsigned)254));
+            }
+        }
+        swap(contigObservations.positions, positions);
+        swap(contigObservations.counts, counts);
+    }
+
+    // reads are parsed sorted by begin position: read starts arrive mostly in order
+    inline void addReadStart(ContigObservations &contigObservations, unsigned pos)
+    {
+        if (pos >= contigObservations.contigLength)
+            return;
+        String<unsigned> &positions = contigObservations.positions;
+        if (!empty(positions) && back(positions) == pos)
+        {
+            if (back(contigObservations.counts) < 254)      // uint8, discard interval if > anyway ...
+                ++back(contigObservations.counts);
+        }
+        else if (empty(positions) || back(positions) < pos)
+        {
+            appendValue(positions, pos);
+            appendValue(contigObservations.counts, (__uint8)1);
+        }
+        else
+        {
+            appendValue(contigObservations.pending, pos);
+            if (length(contigObservations.pending) >= (1u << 20))
+                finalize(contigObservations);
+        }
+    }
+
     void reverse(ContigObservations &contigObservations)
     {    
-        reverse(contigObservations.truncCounts); 
+        finalize(contigObservations);
+        reverse(contigObservations.positions);
+        reverse(contigObservations.counts);
+        for (unsigned k = 0; k < length(contigObservations.positions); ++k)
+            contigObservations.positions[k] = contigObservations.contigLength - contigObservations.positions[k] - 1;
+    }
+
+    // first position >= pos with read starts, end if none before end
+    inline unsigned nextCoveredPos(ContigObservations const &contigObservations, unsigned pos, unsigned end)
+    {
+        String<unsigned> const &positions = contigObservations.positions;
+        unsigned const * it = std::lower_bound(begin(positions, Standard()), seqan::end(positions, Standard()), pos);
+        if (it == seqan::end(positions, Standard()))
+            return end;
+        return std::min(*it, end);
+    }
+
+    // first position >= pos without read starts, at most end
+    inline unsigned coveredRunEnd(ContigObservations const &contigObservations, unsigned pos, unsigned end)
+    {
+        String<unsigned> const &positions = contigObservations.positions;
+        unsigned k = std::lower_bound(begin(positions, Standard()), seqan::end(positions, Standard()), pos) - begin(positions, Standard());
+        if (k >= length(positions) || positions[k] != pos)
+            return std::min(pos, end);
+        while (k + 1 < length(positions) && positions[k + 1] == positions[k] + 1 && positions[k + 1] < end)
+            ++k;
+        return std::min(positions[k] + 1, end);
+    }
+
+    // max. read start count within [c1, c2)
+    inline unsigned getMaxCount(ContigObservations const &contigObservations, unsigned c1, unsigned c2)
+    {
+        String<unsigned> const &positions = contigObservations.positions;
+        unsigned k = std::lower_bound(begin(positions, Standard()), end(positions, Standard()), c1) - begin(positions, Standard());
+        unsigned maxCount = 0;
+        for (; k < length(positions) && positions[k] < c2; ++k)
+            maxCount = std::max(maxCount, (unsigned)contigObservations.counts[k]);
+        return maxCount;
+    }
+
+    // dense read start counts of [c1, c2)
+    inline void getTruncCounts(String<__uint8> &truncCounts, ContigObservations const &contigObservations, unsigned c1, unsigned c2)
+    {
+        resize(truncCounts, c2 - c1, 0, Exact());
+        String<unsigned> const &positions = contigObservations.positions;
+        unsigned k = std::lower_bound(begin(positions, Standard()), end(positions, Standard()), c1) - begin(positions, Standard());
+        for (; k < length(positions) && positions[k] < c2; ++k)
+            truncCounts[positions[k] - c1] = contigObservations.counts[k];
+    }
+
+
+    // read start counts within [t - w, t + w] of each position, running sum updated when t moves by one
+    template <typename TCounts>
+    inline void getWindowCounts(String<unsigned> &sums, TCounts const &counts, unsigned w)
+    {
+        unsigned n = length(counts);
+        resize(sums, n, Exact());
+        unsigned sum = 0;
+        for (unsigned i = 0; i < n && i <= w; ++i)
+            sum += counts[i];
+        for (unsigned t = 0; t < n; ++t)
+        {
+            if (t > 0)
+            {
+                if (t > w)
+                    sum -= counts[t - w - 1];
+                if (t + w < n)
+                    sum += counts[t + w];
+            }
+            sums[t] = sum;
+        }
     }
 
 
     // workaround because partially specialized member function are forbidden
     // wrapper class for observations
     struct Observations {
-        Infix<String<__uint8> >::Type truncCounts;
+        String<__uint8> truncCounts;
         unsigned contigId; 
 
         String<__uint16>    nEstimates;      
@@ -209,7 +438,7 @@ namespace seqan {
         String<float>       fimoScores; // for each t: one motif score
         String<char>        motifIds; // for each t: one motif score
 
-        Observations(Infix<String<__uint8> >::Type _truncCounts) : truncCounts(_truncCounts) {}
+        Observations(String<__uint8> const &_truncCounts) : truncCounts(_truncCounts) {}
         Observations() : truncCounts() {}
 
         void estimateNs(AppOptions &options);                       // using raw counts
@@ -221,7 +450,7 @@ namespace seqan {
     };
 
     inline unsigned Observations::length() {
-        return endPosition(this->truncCounts) - beginPosition(this->truncCounts); // length(this->truncCounts);
+        return seqan::length(this->truncCounts);
     }
 
     
@@ -230,14 +459,10 @@ namespace seqan {
         resize(this->nEstimates, length(), Exact());
         unsigned w_50 = floor((double)options.binSize/2.0 - 0.1);    // binSize should be odd
 
+        String<unsigned> sums;
+        getWindowCounts(sums, this->truncCounts, w_50);
         for (unsigned t = 0; t < length(); ++t)
-        {
-            unsigned sum = 0;
-            for (unsigned j = std::max((int)t - (int)w_50, (int)0); (j < length()) && (j <= t + w_50); ++j)  // inefficient... update on the fly
-                sum += this->truncCounts[j];
-            
-             this->nEstimates[t] = std::max(sum, (unsigned)1); 
-        }
+             this->nEstimates[t] = std::max(sums[t], (unsigned)1); 
     }
 
     // use simple linear regression, estimate from KDE values
@@ -270,72 +495,326 @@ namespace seqan {
         
         return (3.0/4.0 * (1.0 - pow(u, 2)));
     }
+    ///////////////////////////////
+    //  triangular kernel for smothing
+    template<typename TType> 
+    double getTriangularKernelDensity(TType const &u)
+    {
+        if (std::abs(u) > 1) return 0.0;
+        
+        return (1.0 - std::abs(u));
+    }
+    ///////////////////////////////
+    //  box kernel for smothing
+    template<typename TType> 
+    double getBoxKernelDensity(TType const &u)
+    {
+        if (std::abs(u) > 1) return 0.0;
+        
+        return 0.5;
+    }
 
-    void Observations::computeKDEs(AppOptions &options)
+    // K(u) of selected kernel
+    inline double getKernelDensity(double u, AppOptions const &options)
     {
-        resize(this->kdes, length());
+        if (options.epanechnikovKernel)
+            return getEpanechnikovKernelDensity(u);
+        else if (options.triangularKernel)
+            return getTriangularKernelDensity(u);
+        else if (options.boxKernel)
+            return getBoxKernelDensity(u);
+        return getGaussianKernelDensity(u);
+    }
 
+    // precompute kernel densities   -> K(d/h) store at position d, for d <= 4*h
+    inline void getKernelDensities(String<double> &kernelDensities, AppOptions const &options)
+    {
         unsigned w_50 = options.bandwidth * 4;
-        // precompute kernel densities
-        String<double> kernelDensities;
-        resize(kernelDensities, w_50 + 1, 0.0);
-
-        // precompute kernel densities   -> K(d/h) store at position d
+        resize(kernelDensities, w_50 + 1, 0.0, Exact());
         for (unsigned i = 0; i <= w_50; ++i)
-        {
-            if (options.gaussianKernel)
-                kernelDensities[i] = getGaussianKernelDensity((double)i/(double)options.bandwidth);
-            else if (options.epanechnikovKernel)
-                kernelDensities[i] = getEpanechnikovKernelDensity((double)i/(double)options.bandwidth);        
-        }
-        for (unsigned t = 0; t < length(); ++t)
+            kernelDensities[i] = getKernelDensity((double)i/(double)options.bandwidth, options);
+    }
+
+    // KDEs of dense counts (zero outside), direct summation within 4*h: reference engine
+    template <typename TCounts>
+    inline void computeDirectKDEs(String<double> &kdes, TCounts const &counts, String<double> const &kernelDensities, AppOptions const &options)
+    {
+        unsigned n = length(counts);
+        resize(kdes, n, Exact());
+
+        unsigned w_50 = options.bandwidth * 4;
+        for (unsigned t = 0; t < n; ++t)
         {
             double kde = 0.0;
-            for (unsigned i = std::max((int)t - (int)w_50, (int)0); (i < length()) && (i <= t + w_50); ++i)  // inefficient if low genome coverage and not selected only for covered regions!!!
+            for (unsigned i = std::max((int)t - (int)w_50, (int)0); (i < n) && (i <= t + w_50); ++i)  // inefficient if low genome coverage and not selected only for covered regions!!!
             { 
-                kde += this->truncCounts[i] * kernelDensities[(unsigned)std::abs((int)t - (int)i)];
+                kde += counts[i] * kernelDensities[(unsigned)std::abs((int)t - (int)i)];
             }
-            this->kdes[t] = kde/(double)options.bandwidth; 
+            kdes[t] = kde/(double)options.bandwidth; 
         }
     }
 
-    // for input truncCounts (not stored in observations)
-    // keep in mind: same intervals used as for target (+- 2*bdw)
-    // could cause underestimation of input KDEs at interval boarders
-    // anyway only very low values of gaussian kernel there
-    void Observations::computeKDEs(String<__uint8> &truncCounts, AppOptions &options)
+    // KDEs of dense counts (zero outside), kernel profile is added around each position with read starts
+    // work proportional to read starts * 8h instead of interval length * 8h
+    template <typename TCounts>
+    inline void computeSparseKDEs(String<double> &kdes, TCounts const &counts, String<double> const &kernelDensities, AppOptions const &options)
     {
-        resize(this->rpkms, length());
+        unsigned n = length(counts);
+        clear(kdes);
+        resize(kdes, n, 0.0, Exact());
 
+        // symmetric profile K(|d|/h) for d in [-4h, 4h], added with vectorized kernel
         unsigned w_50 = options.bandwidth * 4;
-        // precompute kernel densities
-        String<double> kernelDensities;
-        resize(kernelDensities, w_50 + 1, 0.0);
+        String<double> profile;
+        resize(profile, 2 * w_50 + 1, Exact());
+        for (unsigned d = 0; d <= w_50; ++d)
+        {
+            profile[w_50 + d] = kernelDensities[d];
+            profile[w_50 - d] = kernelDensities[d];
+        }
+        TAddScaledProfile addScaledProfile = kdeKernels().addScaledProfile;
+        double * out = begin(kdes, Standard());
+        for (unsigned i = 0; i < n; ++i)
+        {
+            if (counts[i] == 0)
+                continue;
+            unsigned tBegin = (i > w_50) ? i - w_50 : 0;
+            unsigned tEnd = std::min(i + w_50 + 1, n);
+            addScaledProfile(out + tBegin, begin(profile, Standard()) + (w_50 + tBegin - i), (double)counts[i], tEnd - tBegin);
+        }
+        for (unsigned t = 0; t < n; ++t)
+            out[t] /= (double)options.bandwidth;
+    }
 
-        // precompute kernel densities   -> K(d/h) store at position d
-        for (unsigned i = 0; i <= w_50; ++i)
+    // KDEs of dense counts (zero outside) for kernels with support [-h, h] (Epanechnikov, triangular, box), exact in O(n):
+    // integer running sums over window [t-h, t+h] of c, c*|d| and c*d^2 (d = i - t), updated when t moves by one
+    template <typename TCounts>
+    inline void computeRunningSumKDEs(String<double> &kdes, TCounts const &counts, AppOptions const &options)
+    {
+        int n = length(counts);
+        __int64 h = options.bandwidth;
+        resize(kdes, n, Exact());
+
+        __int64 l0 = 0;     // sum c, d <= 0
+        __int64 r0 = 0;     // sum c, d > 0
+        __int64 l1 = 0;     // sum c*|d|, d <= 0
+        __int64 r1 = 0;     // sum c*d, d > 0
+        __int64 m2 = 0;     // sum c*d^2
+        for (int i = 0; i < n && i <= h; ++i)
         {
-            if (options.gaussianKernel)
-                kernelDensities[i] = getGaussianKernelDensity((double)i/(double)options.bandwidth);
-            else if (options.epanechnikovKernel)
-                kernelDensities[i] = getEpanechnikovKernelDensity((double)i/(double)options.bandwidth);        
+            __int64 c = counts[i];
+            if (i == 0)
+                l0 += c;
+            else
+            {
+                r0 += c;
+                r1 += c * i;
+            }
+            m2 += c * i * i;
         }
-        for (unsigned t = 0; t < length(); ++t)
+        for (int t = 0; t < n; ++t)
         {
-            double kde = 0.0;
-            for (unsigned i = std::max((int)t - (int)w_50, (int)0); (i < length()) && (i <= t + w_50); ++i)  // inefficient if low genome coverage and not selected only for covered regions!!!
-            { 
-                kde += truncCounts[i] * kernelDensities[(unsigned)std::abs((int)t - (int)i)];
+            if (t > 0)
+            {
+                // d -= 1 for window elements, element t moves from d = 1 to d = 0
+                m2 += (l0 + r0) - 2 * (r1 - l1);
+                l1 += l0;
+                r1 -= r0;
+                __int64 c = counts[t];
+                l0 += c;
+                r0 -= c;
+                if (t - h - 1 >= 0)     // leaving at d = -h-1
+                {
+                    c = counts[t - h - 1];
+                    l0 -= c;
+                    l1 -= c * (h + 1);
+                    m2 -= c * (h + 1) * (h + 1);
+                }
+                if (t + h < n)          // entering at d = h
+                {
+                    c = counts[t + h];
+                    r0 += c;
+                    r1 += c * h;
+                    m2 += c * h * h;
+                }
             }
-            if (options.useLogRPKM)
+            double kde;
+            if (options.boxKernel)
+                kde = 0.5 * (double)(l0 + r0);
+            else if (options.triangularKernel)
+                kde = (double)(l0 + r0) - (double)(l1 + r1) / (double)h;
+            else
+                kde = 0.75 * ((double)(l0 + r0) - (double)m2 / (double)(h * h));
+            kdes[t] = kde/(double)options.bandwidth;
+        }
+    }
+
+    // in-place iterative radix-2 FFT, length has to be a power of 2, inverse is not scaled
+    inline void fft(String<std::complex<double> > &a, bool inverse)
+    {
+        unsigned n = length(a);
+        for (unsigned i = 1, j = 0; i < n; ++i)     // bit reversal permutation
+        {
+            unsigned bit = n >> 1;
+            for (; j & bit; bit >>= 1)
+                j ^= bit;
+            j ^= bit;
+            if (i < j)
+                std::swap(a[i], a[j]);
+        }
+        for (unsigned len = 2; len <= n; len <<= 1)
+        {
+            double angle = 2.0 * M_PI / (double)len * ((inverse) ? 1.0 : -1.0);
+            std::complex<double> wLen(cos(angle), sin(angle));
+            for (unsigned i = 0; i < n; i += len)
             {
-                if ((kde/(double)options.bandwidth) > 0.0)
-                    this->rpkms[t] = log(kde/(double)options.bandwidth); 
+                std::complex<double> w(1.0, 0.0);
+                for (unsigned j = 0; j < len / 2; ++j)
+                {
+                    std::complex<double> u = a[i + j];
+                    std::complex<double> v = a[i + j + len / 2] * w;
+                    a[i + j] = u + v;
+                    a[i + j + len / 2] = u - v;
+                    w *= wLen;
+                }
+            }
+        }
+    }
+
+    // KDEs of dense counts (zero outside) as circular convolution with kernel truncated at 4*h, no wrap-around for N >= n + 4*h
+    // counts and kernel are real: both transformed at once as real and imaginary part
+    template <typename TCounts>
+    inline void computeFftKDEs(String<double> &kdes, TCounts const &counts, String<double> const &kernelDensities, AppOptions const &options)
+    {
+        unsigned n = length(counts);
+        unsigned w_50 = options.bandwidth * 4;
+        unsigned fftLen = 1;
+        while (fftLen < n + w_50)
+            fftLen <<= 1;
+
+        String<std::complex<double> > z;
+        resize(z, fftLen, std::complex<double>(0.0, 0.0), Exact());
+        for (unsigned t = 0; t < n; ++t)
+            z[t].real((double)counts[t]);
+        for (unsigned d = 0; d <= w_50 && d < fftLen; ++d)
+        {
+            z[d].imag(kernelDensities[d]);
+            if (d > 0)
+                z[fftLen - d].imag(kernelDensities[d]);
+        }
+        fft(z, false);
+
+        // X = (Z[m] + conj(Z[N-m]))/2, K = (Z[m] - conj(Z[N-m]))/2i, X*K = (Z[m]^2 - conj(Z[N-m])^2)/4i
+        String<std::complex<double> > y;
+        resize(y, fftLen, Exact());
+        for (unsigned m = 0; m < fftLen; ++m)
+        {
+            std::complex<double> a = z[m];
+            std::complex<double> b = std::conj(z[(fftLen - m) & (fftLen - 1)]);
+            y[m] = (a * a - b * b) * std::complex<double>(0.0, -0.25);
+        }
+        fft(y, true);
+
+        // rounding noise where no read start is within 4*h: set to 0 as with direct summation (min. non-zero value is K(4))
+        double minKde = 0.5 * kernelDensities[w_50];
+        resize(kdes, n, Exact());
+        for (unsigned t = 0; t < n; ++t)
+        {
+            double kde = y[t].real() / (double)fftLen;
+            kdes[t] = (kde >= minKde) ? kde/(double)options.bandwidth : 0.0;
+        }
+    }
+
+    // KDEs of dense counts (zero outside) using selected engine
+    // FFT only if cheaper than direct summation, e.g. not for short intervals with small bandwidth (sparse then)
+    template <typename TCounts>
+    inline void computeDenseKDEs(String<double> &kdes, TCounts const &counts, String<double> const &kernelDensities, AppOptions const &options)
+    {
+        if (!options.gaussianKernel && options.kdeEngine != KDE_DIRECT)     // compact support, cost independent of h
+        {
+            computeRunningSumKDEs(kdes, counts, options);
+            return;
+        }
+        if (options.kdeEngine == KDE_FFT)
+        {
+            double n = length(counts);
+            double fftLen = n + options.bandwidth * 4;
+            if (n * (options.bandwidth * 8 + 1) > 6.0 * fftLen * log2(fftLen))
+            {
+                computeFftKDEs(kdes, counts, kernelDensities, options);
+                return;
+            }
+        }
+        if (options.kdeEngine == KDE_DIRECT)
+            computeDirectKDEs(kdes, counts, kernelDensities, options);
+        else
+            computeSparseKDEs(kdes, counts, kernelDensities, options);
+    }
+
+    void Observations::computeKDEs(AppOptions &options)
+    {
+        String<double> kernelDensities;
+        getKernelDensities(kernelDensities, options);
+        computeDenseKDEs(this->kdes, this->truncCounts, kernelDensities, options);
+    }
+
+    // for input truncCounts (not stored in observations)
+    // keep in mind: same intervals used as for target (+- 2*bdw)
+    // could cause underestimation of input KDEs at interval boarders
+    // anyway only very low values of gaussian kernel there
+    void Observations::computeKDEs(String<__uint8> &truncCounts, AppOptions &options)
+    {
+        String<double> kernelDensities;
+        getKernelDensities(kernelDensities, options);
+        computeDenseKDEs(this->rpkms, truncCounts, kernelDensities, options);
+        if (options.useLogRPKM)
+        {
+            for (unsigned t = 0; t < length(); ++t)
+            {
+                if (this->rpkms[t] > 0.0)
+                    this->rpkms[t] = log(this->rpkms[t]); 
                 else 
                     this->rpkms[t] = options.minRPKMtoFit - 1.0; 
             }
-            else
-                this->rpkms[t] = kde/(double)options.bandwidth; 
+        }
+    }
+
+
+    // KDEs (not log-transformed) of whole contig and strand, computed only within 4*h of read starts
+    // runs: [begin, end) pairs of positions with values, values: KDEs of all runs
+    inline void computeContigKDEs(String<unsigned> &runs, String<float> &values, ContigObservations const &contigObservations, AppOptions &options)
+    {
+        clear(runs);
+        clear(values);
+        String<unsigned> const &positions = contigObservations.positions;
+        if (empty(positions))
+            return;
+
+        unsigned w_50 = options.bandwidth * 4;
+        String<double> kernelDensities;
+        getKernelDensities(kernelDensities, options);
+
+        String<double> runKdes;
+        unsigned k = 0;
+        while (k < length(positions))
+        {
+            // merge windows of read starts closer than 2*w_50
+            unsigned runBegin = (positions[k] > w_50) ? positions[k] - w_50 : 0;
+            unsigned kEnd = k + 1;
+            while (kEnd < length(positions) && positions[kEnd] - positions[kEnd - 1] <= 2 * w_50 + 1)
+                ++kEnd;
+            unsigned runEnd = std::min(positions[kEnd - 1] + w_50 + 1, contigObservations.contigLength);
+            appendValue(runs, runBegin);
+            appendValue(runs, runEnd);
+
+            String<unsigned> runCounts;
+            resize(runCounts, runEnd - runBegin, 0, Exact());
+            for (unsigned j = k; j < kEnd; ++j)
+                runCounts[positions[j] - runBegin] = contigObservations.counts[j];
+            computeDenseKDEs(runKdes, runCounts, kernelDensities, options);
+            for (unsigned t = 0; t < length(runKdes); ++t)
+                appendValue(values, (float)runKdes[t]);
+            k = kEnd;
         }
     }
 
@@ -345,6 +824,7 @@ namespace seqan {
         String<String<unsigned> >                   setPos;
         String<String<String<String<double> > > >   statePosteriors;  // F/R:state:interval:t
         String<String<String<__uint8> > >           states;
+        String<String<String<double> > >            stateScores;      // F/R:interval:t, only if loaded from posterior file
     };
 
     void append(Data &dataA, Data &dataB)
@@ -359,6 +839,11 @@ namespace seqan {
                 append(dataA.statePosteriors[s], dataB.statePosteriors[s]);
             if (!empty(dataB.states[s]))
                 append(dataA.states[s], dataB.states[s]); 
+            if (!empty(dataB.stateScores) && !empty(dataB.stateScores[s]))
+            {
+                resize(dataA.stateScores, 2);
+                append(dataA.stateScores[s], dataB.stateScores[s]);
+            }
         }
     }
 
@@ -368,6 +853,28 @@ namespace seqan {
         clear(data.setPos);
         clear(data.statePosteriors);
         clear(data.states);
+        clear(data.stateScores);
+    }
+
+    // log posterior prob. ratio score of state at t (as stored if loaded from posterior file)
+    inline double getStateScore(Data &data, unsigned s, unsigned i, unsigned t)
+    {
+        if (!empty(data.stateScores))
+            return data.stateScores[s][i][t];
+
+        double secondBest = 0.0;
+        for (unsigned k = 0; k < 4; ++k)
+        {
+            if (k != (unsigned)data.states[s][i][t] && data.statePosteriors[s][k][i][t] > secondBest)
+                secondBest = data.statePosteriors[s][k][i][t];
+        }                    
+        return (double)log(data.statePosteriors[s][data.states[s][i][t]][i][t] / std::max(secondBest, DBL_MIN) );
+    }
+
+    // log ratio of enriched (states 2, 3) and non-enriched (states 0, 1) posterior prob. at t
+    inline double getEnrichmentScore(Data &data, unsigned s, unsigned i, unsigned t)
+    {
+        return (double)log((data.statePosteriors[s][2][i][t] + data.statePosteriors[s][3][i][t])/(data.statePosteriors[s][0][i][t] + data.statePosteriors[s][1][i][t]));
     }
 
 }